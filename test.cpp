@@ -1,9 +1,14 @@
 #include <cstdio>
 #include <cassert>
+#include <thread>
+#include <sstream>
 #include <iostream>
 
 #include "yare.hpp"
 
+#define YAREGEN_NO_MAIN
+#include "yaregen.cpp"
+
 using namespace std;
 
 //--DEFINE HELPFUL MACROS--
@@ -17,6 +22,54 @@ using namespace std;
 #define ASSERT_RP(PATTERN, STR, STARGET, TARGET)	PRTL; assert(yare::replace(PATTERN, STR, STARGET) == TARGET)
 #define ASSERT_MCS(PATTERN, STR, TARGET)			PRTL; assert(yare::matches(PATTERN, STR) == TARGET)
 
+// fewer than max_len pieces of alphabet picked by a generator seeded with i, so the same i gives the same text
+template <typename Alphabet>
+string
+random_text(unsigned i, const Alphabet &alphabet, unsigned max_len)
+{
+    string text;
+    for (unsigned j = 0, seed = i; j < i % max_len; ++j, seed = seed * 1103515245u + 12345u)
+    {
+        text += alphabet[(seed >> 8) % size(alphabet)];
+    }
+    return text;
+}
+
+// fewer than max_runs runs of up to 39 copies of one piece of alphabet each, seeded with i like random_text,
+// so the skips over long runs of one byte get exercised
+template <typename Alphabet>
+string
+random_runs(unsigned i, const Alphabet &alphabet, unsigned max_runs)
+{
+    string text;
+    for (unsigned j = 0, seed = i; j < i % max_runs; ++j, seed = seed * 1103515245u + 12345u)
+    {
+        for (unsigned k = (seed >> 16) % 40; k; --k)
+        {
+            text += alphabet[(seed >> 8) % size(alphabet)];
+        }
+    }
+    return text;
+}
+
+// two engines which have to give the same answer on texts(i) for every i < count, the first i they differ
+// on is printed before the assert fails
+template <typename Texts, typename Expected, typename Actual>
+void
+differential(unsigned count, Texts texts, Expected expected, Actual actual)
+{
+    for (unsigned i = 0; i < count; ++i)
+    {
+        auto text = texts(i);
+        bool same = expected(text) == actual(text);
+        if (!same)
+        {
+            printf("the engines differ on text %u\n", i);
+        }
+        assert(same);
+    }
+}
+
 
 //--TEST NORMAL MATCH METHOD--
 
@@ -174,6 +227,46 @@ TEST(REPLACE_M)
     ASSERT_RP("(?:<sec>25[0-5]|2[0-4][0-9]|1[0-9]{2}|[1-9][0-9]|[0-9])(\\.(?:<sec>)){3}", "ipv4: 192.168.1.1", "***.***.***.***", "ipv4: ***.***.***.***");
 END
 
+TEST(REPLACE_TO_M)
+    {
+        auto pattern = yare::Pattern("(?:<sec>25[0-5]|2[0-4][0-9]|1[0-9]{2}|[1-9][0-9]|[0-9])(\\.(?:<sec>)){3}");
+        string res;
+        pattern.replace_to(back_inserter(res), "ipv4: 192.168.1.1, 10.0.0.254", "<$&|$1|$2|${sec}|${1}|$$|$9|${x}>");
+        PRTL; assert(res == "ipv4: <192.168.1.1|1|.1|1|1|$||>, <10.0.0.254|254|.254|254|254|$||>");
+    }
+
+    {
+        auto pattern = yare::Pattern("(a+)(b*)c");
+        string res;
+        pattern.replace_to(back_inserter(res), "xaacybcaabbbc", "[$2$1]");
+        PRTL; assert(res == "x[aa]ybc[bbbaa]");
+
+        // a group number past size_t names no group
+        res.clear();
+        pattern.replace_to(back_inserter(res), "aac", "[$99999999999999999999|${184467440737095516160}|$1]");
+        PRTL; assert(res == "[||aa]");
+    }
+
+    {
+        auto pattern = yare::Pattern("[0-9]+|陈轶阳");
+        string res;
+        pattern.replace_with(back_inserter(res), "id=42, name=陈轶阳", [](string_view match)
+        {
+            return string(match.size(), '*');
+        });
+        PRTL; assert(res == "id=**, name=*********");
+    }
+
+    // the u32string versions go the same way as the byte ones, also over text which almost matches throughout
+    {
+        auto pattern = yare::Pattern("陈+b|a*c");
+        auto str = yare::details::str_to_utf8("x陈陈bya陈c") + u32string(200000, U'a');
+        PRTL; assert(pattern.search(str) == yare::details::str_to_utf8("陈陈b"));
+        PRTL; assert(pattern.replace(str, U"-") == yare::details::str_to_utf8("x-ya陈-") + u32string(200000, U'a'));
+        PRTL; assert(pattern.search(u32string(200000, U'a')).empty());
+    }
+END
+
 
 //--TEST MATCHES METHOD--
 
@@ -189,6 +282,847 @@ TEST(MATCHES_M)
     );
 END
 
+TEST(FIND_ITER_M)
+    {
+        auto pattern = yare::Pattern("a[bc]+");
+        string str = "ab cccccab ccccccccaccccb b";
+        vector<string_view> found(pattern.find_iter(str).begin(), pattern.find_iter(str).end());
+        PRTL; assert(found == vector<string_view>({ "ab", "ab", "accccb" }));
+        PRTL; assert(found[1].data() == str.data() + 8);
+        PRTL; assert(pattern.count(str) == 3);
+        PRTL; assert(pattern.count("xyz") == 0);
+
+        size_t seen = 0;
+        for (auto match : pattern.find_iter(str))
+        {
+            if (++seen == 2)
+            {
+                assert(match == "ab");
+                break;
+            }
+        }
+    }
+
+    {
+        auto pattern = yare::Pattern("陈轶阳|苏畅");
+        PRTL; assert(pattern.count("陈轶阳 苏畅 陈轶阳666") == 3);
+    }
+
+    {
+        // every start is one thread of the same scan, a failed start costs no rescan
+        auto pattern = yare::Pattern("a*[bc]d");
+        string str = string(200000, 'a') + "bx";
+        PRTL; assert(pattern.count(str) == 0);
+        str += "aacd";
+        vector<string_view> found(pattern.find_iter(str).begin(), pattern.find_iter(str).end());
+        PRTL; assert(found == vector<string_view>({ "aacd" }));
+        PRTL; assert(found[0].data() == str.data() + 200002);
+    }
+
+    {
+        auto pattern = yare::Pattern("ab|bcdef|c[a-z]*");
+        PRTL; assert(pattern.search("xabcdef") == "ab");
+        PRTL; assert(pattern.search("xbcdefg") == "bcdef");
+        PRTL; assert(pattern.search("xbcdxcy") == "cdxcy");
+        PRTL; assert(yare::search("ab|bcdef|c[a-z]*$", "xbcdx1cy") == "cy");
+    }
+END
+
+//--TEST LITERAL ALTERNATIONS--
+
+TEST(LITERALS)
+    ASSERT_SC("bcd|abc", "xabcd", "abc");
+    ASSERT_SC("bc|abcd", "xabcd", "abcd");
+    ASSERT_SC("he|she|hers|his", "ushers", "she");
+    ASSERT_SC("ab|b$", "xabab", "ab");
+    ASSERT_SC("ab|b$", "xabx", "");
+    ASSERT_SC("\\.com|\\.org", "mu00@jusot.com", ".com");
+    ASSERT_RP("cat|dog", "cat and dog", "pet", "pet and pet");
+
+    // must agree with the same alternation compiled through the DFA
+    for (auto pattern : { "a|ab|abc", "^ab|b", "ab|b$", "he|she|hers|his", "陈轶阳|苏畅" })
+    {
+        auto wrapped = string(pattern);
+        auto split = wrapped.find_first_not_of('^');
+        wrapped.insert(split, "(");
+        wrapped.insert(wrapped.back() == '$' ? wrapped.size() - 1 : wrapped.size(), ")");
+
+        for (auto str : { "", "a", "abcd", "xab", "xxab", "ushers", "hishe", "666苏畅" })
+        {
+            PRTL;
+            assert(yare::match(pattern, str) == yare::match(wrapped, str));
+            assert(yare::search(pattern, str) == yare::search(wrapped, str));
+        }
+    }
+
+    {
+        string keywords;
+        for (int i = 0; i < 20000; ++i)
+        {
+            keywords += (i ? "|word" : "word") + to_string(i * 7);
+        }
+        auto pattern = yare::Pattern(keywords);
+        ASSERT_WP("word139993", "word139993");
+        ASSERT_WP("word13", "");
+        PRTL; assert(pattern.search("blocked: word70007!") == "word70007");
+    }
+END
+
+//--TEST BATCH METHODS--
+
+TEST(BATCH_M)
+    {
+        auto pattern = yare::Pattern("[a-c]+[A-C]");
+        vector<string> data = { "abcABC", "AAA", "", "cC", "bbbB!", "陈abcA" };
+        vector<string_view> strs;
+        for (int i = 0; i < 10000; ++i)
+        {
+            strs.push_back(data[i % data.size()]);
+        }
+
+        vector<size_t> lengths(strs.size());
+        pattern.match_batch(strs.data(), strs.size(), lengths.data());
+        for (size_t i = 0; i < strs.size(); ++i)
+        {
+            auto res = pattern.match(string(strs[i]));
+            assert(lengths[i] == (res.empty() ? string::npos : res.size()));
+        }
+
+        auto executor = [](size_t n, const function<void(size_t)> &task)
+        {
+            vector<thread> threads;
+            for (size_t i = 0; i < n; ++i)
+            {
+                threads.emplace_back(task, i);
+            }
+            for (auto &t : threads)
+            {
+                t.join();
+            }
+        };
+        vector<uint64_t> bitmap((strs.size() + 63) / 64);
+        pattern.match_bitmap(strs.data(), strs.size(), bitmap.data(), executor);
+        for (size_t i = 0; i < strs.size(); ++i)
+        {
+            assert(((bitmap[i / 64] >> i % 64) & 1) == (lengths[i] != string::npos));
+        }
+    }
+
+    // lanes finish at different times, results must still land on their own inputs
+    for (auto regex : { "a[bc]+", "6+陈轶阳6+[^苏畅]*6+", "(ab|c)*d$", "x*" })
+    {
+        auto pattern = yare::Pattern(regex);
+        string alphabet[] = { "a", "b", "c", "d", "x", "6", "陈", "轶", "阳", "苏" };
+        vector<string> data;
+        for (int i = 0; i < 1000; ++i)
+        {
+            auto str = random_text(i, alphabet, 23);
+            data.push_back(str);
+        }
+        vector<string_view> strs(data.begin(), data.end());
+        vector<size_t> lengths(strs.size());
+        pattern.match_batch(strs.data(), strs.size(), lengths.data());
+
+        PRTL; differential(data.size(), [](unsigned i) { return i; }, [&](unsigned i)
+        {
+            auto res = yare::details::utf8_to_str(pattern.match(yare::details::str_to_utf8(data[i])));
+            return !res.empty() ? res.size() : pattern.matches_empty() ? 0 : string::npos;
+        }, [&](unsigned i) { return lengths[i]; });
+    }
+
+    {
+        auto pattern = yare::Pattern("2333$");
+        string_view strs[] = { "2333", "23332", "233", "2333" };
+        uint64_t bitmap = 0;
+        pattern.match_bitmap(strs, 4, &bitmap);
+        PRTL; assert(bitmap == 0b1001);
+    }
+
+    // a lane finishing on the first string of the second word, and one match per group of eight lanes
+    {
+        auto pattern = yare::Pattern("ab+");
+        vector<string_view> strs(65, "ba");
+        strs[64] = strs[8] = strs[15] = "abb";
+        vector<uint64_t> bitmap(2);
+        pattern.match_bitmap(strs.data(), strs.size(), bitmap.data());
+        PRTL; assert(bitmap[0] == (1u << 8 | 1u << 15) && bitmap[1] == 1);
+    }
+END
+
+//--TEST SELF LOOPS--
+
+TEST(SELF_LOOP)
+    for (auto regex : { "[^\"]*\"", ".*x", "\\s+a", "\\w+@", "a[^,]*,b", "(ab|c)*d$" })
+    {
+        auto pattern = yare::Pattern(regex);
+        string alphabet[] = { "a", "b", "c", "d", "x", "\"", "@", " ", ",", "\t", "陈", "_", "9" };
+        PRTL; differential(3000, [&](unsigned i) { return random_runs(i, alphabet, 7); }, [&](const string &str)
+        {
+            return yare::details::utf8_to_str(pattern.match(yare::details::str_to_utf8(str)));
+        }, [&](const string &str) { return pattern.match(str); });
+    }
+
+    // the byte leaving the loop on either side of a 16 and a 32 byte step, and a character cut by one
+    for (size_t n : { 15, 16, 17, 31, 32, 33, 63, 64, 65 })
+    {
+        ASSERT("[^\"]*\"", string(n, 'a') + "\"b", string(n, 'a') + "\"");
+        ASSERT("[^\"]*\"", string(n, 'a'), "");
+        ASSERT("\\s+a", string(n, ' ') + "a", string(n, ' ') + "a");
+        ASSERT(".*x", string(n - 1, 'a') + "x" + string(n, 'a'), string(n - 1, 'a') + "x");
+        ASSERT("a[^,]*,b", "a" + string(n - 2, 'b') + "陈,b", "a" + string(n - 2, 'b') + "陈,b");
+    }
+END
+
+//--TEST JIT--
+
+TEST(JIT)
+    for (auto regex : { "a[bc]+", "[^\"]*\"", "6+陈轶阳6+[^苏畅]*6+", "(ab|c)*d$", "x*", "[a-z]+@[a-z]+\\.com", "^ab+|b" })
+    {
+        auto pattern = yare::Pattern(regex), jitted = pattern;
+#ifdef YARE_JIT
+        PRTL; assert(jitted.enable_jit());
+#else
+        jitted.enable_jit();
+#endif
+
+        string alphabet[] = { "a", "b", "c", "d", "x", "\"", "@", ".", "6", "陈", "轶", "阳", "苏" };
+        PRTL; differential(2000, [&](unsigned i) { return random_text(i, alphabet, 19); }, [&](const string &str)
+        {
+            return make_pair(pattern.match(str), pattern.search(str));
+        }, [&](const string &str) { return make_pair(jitted.match(str), jitted.search(str)); });
+    }
+
+    // the native code keeps the anchors, stops at a NUL and leaves a character cut at the end unread
+    auto jitted = yare::Pattern("(ab|c)*d$");
+    jitted.enable_jit();
+    PRTL; assert(jitted.match("abcd") == "abcd" && jitted.match("abcdd") == "" && jitted.search("xabd") == "abd");
+    jitted = yare::Pattern("^ab+|b");
+    jitted.enable_jit();
+    PRTL; assert(jitted.search("xabb") == "" && jitted.search("abbx") == "abb" && jitted.match(string("ab\0b", 4)) == "ab");
+    jitted = yare::Pattern("a[^x]*");
+    jitted.enable_jit();
+    PRTL; assert(jitted.match("aa\xe9\x99") == "aa");
+END
+
+//--TEST REQUIRED LITERAL--
+
+TEST(REQUIRED_LITERAL)
+    for (auto regex : { "\\d+\\.\\d+ms latency=", ".*@example\\.com", "(ab|cb)d+e", "x(abc){2}y", "a(bc)?d", "[a-c]+陈d{1,3}", "b(a|ca)+d", "[a-e]{1,3}\\.1 ?ms" })
+    {
+        auto pattern = yare::Pattern(regex);
+        string alphabet[] = { "a", "b", "c", "d", "e", "x", "y", "1", ".", "ms latency=", "@example.com", "陈" };
+        PRTL; differential(3000, [&](unsigned i) { return random_text(i, alphabet, 23); }, [&](const string &str)
+        {
+            return yare::details::utf8_to_str(pattern.search(yare::details::str_to_utf8(str)));
+        }, [&](const string &str) { return pattern.search(str); });
+    }
+
+    ASSERT_SC("\\d+\\.\\d+ms latency=", "t=12.5ms latency=", "12.5ms latency=");
+    ASSERT_SC("x(abc){2}y", "xabcy xabcabcy", "xabcabcy");
+
+    // a hit of the literal which no match goes through, a literal inside a longer run of it, and a match
+    // starting far before the hit
+    ASSERT_SC("\\d+\\.\\d+ms latency=", "1.5ms latency 2.25ms latency=", "2.25ms latency=");
+    ASSERT_SC("x(abc){2}y", "xabcabcabcy", "");
+    ASSERT_SC("x(abc){2}y", "abcabcy xabcabcy", "xabcabcy");
+    ASSERT_SC(".*@example\\.com", "a@b-@example.co-x@example.com", "a@b-@example.co-x@example.com");
+    ASSERT_SC("[a-c]+陈d{1,3}", "ab陈 c陈dddd", "c陈ddd");
+END
+
+//--TEST ANALYSIS--
+
+TEST(ANALYSIS)
+    auto npos = std::string::npos;
+    PRTL; assert(yare::Pattern("x(abc){2}y").min_length() == 8 && yare::Pattern("x(abc){2}y").max_length() == 8);
+    PRTL; assert(yare::Pattern("陈.").min_length() == 4 && yare::Pattern("陈.").max_length() == 7);
+    PRTL; assert(yare::Pattern("a+b?").min_length() == 1 && yare::Pattern("a+b?").max_length() == npos);
+    PRTL; assert(yare::Pattern("foo|barbaz").min_length() == 3 && yare::Pattern("foo|barbaz").max_length() == 6);
+    PRTL; assert(yare::Pattern("[^]").min_length() == npos && yare::Pattern("[^]").max_length() == 0);
+    PRTL; assert(yare::Pattern("a*").matches_empty() && !yare::Pattern("a|bcd").matches_empty());
+    PRTL; assert(yare::Pattern("^abc").anchored() && !yare::Pattern("abc$").anchored());
+    ASSERT("abc", "ab", "");
+    ASSERT_SC("ab[cd]", "xxabxabd", "abd");
+END
+
+//--TEST SIMPLIFY--
+
+TEST(SIMPLIFY)
+    for (auto regex : { "abc|abd|a|b|[cd]", "(a*)*b|(a+)*c|(a?)+d", "(ab|ab|a)c{1}", "x(abc|abd)*y|x.z", "陈轶|陈阳|苏畅", "(a|b|c)+d?e|(ab)(cd)$", "ab{0,}c|a(b*)?c" })
+    {
+        auto str = yare::details::str_to_utf8(regex);
+        auto simplified_dfa = std::get<0>(yare::details::Parse().gen_dfa(str.c_str()));
+        auto parsed_dfa = std::get<0>(yare::details::Parse().gen_dfa(str.c_str(), false));
+        auto simplified = yare::details::DFATable(simplified_dfa), parsed = yare::details::DFATable(parsed_dfa);
+        yare::details::release(simplified_dfa);
+        yare::details::release(parsed_dfa);
+        string alphabet[] = { "a", "b", "c", "d", "e", "x", "y", "z", "陈", "轶", "阳", "苏", "畅" };
+        PRTL; differential(3000, [&](unsigned i) { return random_text(i, alphabet, 11); },
+            [&](const string &text) { return parsed.match(text, false); },
+            [&](const string &text) { return simplified.match(text, false); });
+    }
+
+    // what the rewrites merge or drop still matches: nested stars, duplicate branches, {1}, {0,} and (x*)?
+    ASSERT("(a*)*b|(a+)*c|(a?)+d", "aaab", "aaab");
+    ASSERT("(a*)*b|(a+)*c|(a?)+d", "d", "d");
+    ASSERT("(ab|ab|a)c{1}", "abc", "abc");
+    ASSERT("(ab|ab|a)c{1}", "acc", "ac");
+    ASSERT("ab{0,}c|a(b*)?c", "ac", "ac");
+    ASSERT("abc|abd|a|b|[cd]", "abd", "abd");
+    ASSERT("陈轶|陈阳|苏畅", "陈阳", "陈阳");
+END
+
+//--TEST LONG EPSILON CHAINS--
+
+TEST(EPSILON_CHAIN)
+    string regex;
+    for (int i = 0; i < 300; ++i)
+    {
+        regex += "a?";
+    }
+    auto pattern = yare::Pattern(regex + "b");
+    ASSERT_WP(string(300, 'a') + "b", string(300, 'a') + "b");
+    ASSERT_WP("b", "b");
+    ASSERT_WP(string(301, 'a') + "b", "");
+END
+
+//--TEST MEMORY USAGE--
+
+TEST(MEMORY_USAGE)
+    auto pattern = yare::Pattern("(a|b)*c"), copy = pattern;
+    auto usage = pattern.memory_usage();
+    PRTL; assert(usage.automaton && usage.captures && !usage.literals);
+    PRTL; assert(usage.total() == copy.memory_usage().total());
+    PRTL; assert(yare::Pattern("foo|bar").memory_usage().literals && !yare::Pattern("foo|bar").memory_usage().automaton);
+    PRTL; assert(!yare::Pattern("[a-z]+\\d").memory_usage().captures);
+    ASSERT_WP(U"abbac", U"abbac");
+END
+
+//--TEST COMPILE STATS--
+
+TEST(COMPILE_STATS)
+    PRTL; assert(!yare::Pattern("a+b").compile_stats());
+
+    auto pattern = yare::Pattern("(a|b)*abb", true);
+    auto stats = *pattern.compile_stats();
+    PRTL; assert(stats.patterns == 1 && stats.nfa_states && stats.classes);
+    PRTL; assert(stats.dfa_states >= stats.minimized_states && stats.minimized_states == 4);
+    PRTL; assert(stats.peak_memory && stats.total() >= stats.subset);
+
+    stats += *yare::Pattern("foo|bar", true).compile_stats();
+    PRTL; assert(stats.patterns == 2 && stats.minimized_states == 4);
+    ASSERT_WP("ababb", "ababb");
+END
+
+//--TEST TELEMETRY--
+
+TEST(TELEMETRY)
+    auto pattern = yare::Pattern("\\d+ms");
+    pattern.match("12ms");
+    pattern.search("took 12ms");
+    pattern.search("none");
+    auto snapshot = pattern.telemetry_snapshot();
+#ifdef YARE_TELEMETRY
+    std::uint64_t timed = 0;
+    for (auto count : snapshot.latency)
+    {
+        timed += count;
+    }
+    PRTL; assert(snapshot.calls == 3 && timed == 3 && snapshot.matches == 2);
+    PRTL; assert(snapshot.prefilter_hits == 1 && snapshot.prefilter_misses == 1);
+    PRTL; assert(snapshot.bytes == 4 + 9 + 4);
+#else
+    PRTL; assert(snapshot.calls == 0 && snapshot.bytes == 0);
+#endif
+END
+
+//--TEST LEXER--
+
+TEST(LEXER)
+    vector<string> rules = { "if", "[a-z]+", "\\d+(\\.\\d+)?", "\\s+", "==|=", "\"[^\"]*\"", "陈+" };
+    auto lexer = yare::Lexer(rules);
+
+    vector<pair<size_t, string>> tokens;
+    for (auto token : lexer.tokenize("if x == 3.14 iffy"))
+    {
+        tokens.push_back({ token.id, string(token.text) });
+    }
+    vector<pair<size_t, string>> expected = {
+        { 0, "if" }, { 3, " " }, { 1, "x" }, { 3, " " }, { 4, "==" }, { 3, " " }, { 2, "3.14" }, { 3, " " }, { 1, "iffy" }
+    };
+    PRTL; assert(tokens == expected);
+    PRTL; assert(lexer.next("#", 0).id == yare::Lexer::kError && lexer.next("#", 0).text == "#");
+    PRTL; assert(lexer.next("#", 1).id == yare::Lexer::kError && lexer.next("#", 1).text.empty() && lexer.next("", 3).text.empty());
+    PRTL; assert(lexer.find("#\"x 1", 0).id == 1 && lexer.find("#\"x 1", 0).text == "x");
+    string hashes = "##";
+    PRTL; assert(lexer.find(hashes, 0).id == yare::Lexer::kError && lexer.find(hashes, 0).text.data() == hashes.data() + 2);
+
+    // a long run of characters which start no token is searched through once
+    auto stuck = yare::Lexer({ "a*b" });
+    string run(200000, 'a');
+    PRTL; assert(count_if(stuck.tokenize(run).begin(), stuck.tokenize(run).end(),
+        [](const yare::Lexer::Token &token) { return token.id == yare::Lexer::kError; }) == 200000);
+
+    // the same as trying every rule in turn and keeping the first of the longest
+    vector<yare::Pattern> patterns(rules.begin(), rules.end());
+    string alphabet[] = { "i", "f", "x", "1", ".", " ", "=", "\"", "#", "陈" };
+    PRTL;
+    for (unsigned i = 0; i < 2000; ++i)
+    {
+        auto str = random_text(i, alphabet, 17);
+        size_t pos = 0;
+        for (auto token : lexer.tokenize(str))
+        {
+            size_t id = yare::Lexer::kError, len = 0;
+            for (size_t k = 0; k < patterns.size(); ++k)
+            {
+                auto res = patterns[k].match(str.substr(pos));
+                if (res.size() > len)
+                {
+                    id = k;
+                    len = res.size();
+                }
+            }
+            assert(token.id == id && token.text.data() == str.data() + pos);
+            assert(id == yare::Lexer::kError || token.text.size() == len);
+            pos += token.text.size();
+        }
+        assert(pos == str.size());
+    }
+END
+
+TEST(PATTERN_SET)
+    yare::PatternSet set;
+    auto digits = set.add("\\d+"), hello = set.add("^hello"), dot = set.add("\\.$"), chen = set.add("陈+");
+    PRTL; assert(set.size() == 4);
+    PRTL; assert(set.matches("hello 42.") == vector<size_t>({ digits, hello, dot }));
+    PRTL; assert(set.matches("say hello. 陈") == vector<size_t>({ chen }));
+    PRTL; assert(!set.any("nothing here") && set.any("."));
+    PRTL; assert(set.remove(digits) && !set.remove(digits) && set.size() == 3);
+    PRTL; assert(set.matches("hello 42.") == vector<size_t>({ hello, dot }));
+    auto empty = set.add("x*");
+    PRTL; assert(set.matches("") == vector<size_t>({ empty }));
+
+    // the same as looking for a match of every pattern at every position, across shards
+    vector<string> rules = { "ab", "a+b", "^b", "a$", "b?c", "(ab|ba)+", "c{2}", "^$", "[^a]a", "陈.", "a*", "^ab$" };
+    yare::PatternSet many;
+    vector<size_t> ids;
+    for (unsigned round = 0; round < 3; ++round)
+    {
+        for (const auto &rule : rules)
+        {
+            ids.push_back(many.add(rule));
+        }
+    }
+    for (size_t k = 0; k < ids.size(); k += 3)
+    {
+        many.remove(ids[k]);
+    }
+    many.compact();
+    PRTL; assert(many.size() == ids.size() - 12);
+
+    string alphabet[] = { "a", "b", "c", " ", "陈" };
+    PRTL;
+    for (unsigned i = 0; i < 1000; ++i)
+    {
+        auto str = random_text(i, alphabet, 9);
+        vector<size_t> expected;
+        for (size_t k = 0; k < ids.size(); ++k)
+        {
+            if (k % 3 == 0)
+            {
+                continue;
+            }
+            auto pattern = yare::details::str_to_utf8(rules[k % rules.size()]);
+            yare::details::DFAPtr dfa;
+            bool begin, end;
+            tie(dfa, begin, end) = yare::details::Parse().gen_dfa(pattern.c_str());
+            yare::details::DFATable table(dfa);
+            for (size_t pos = 0; pos <= (begin ? 0 : str.size()); pos += pos < str.size() ? yare::details::utf8_length(str[pos]) : 1)
+            {
+                auto len = table.match(string_view(str).substr(pos), false);
+                if (len != string::npos && (!end || len == str.size() - pos))
+                {
+                    expected.push_back(ids[k]);
+                    break;
+                }
+            }
+            yare::details::release(dfa);
+        }
+        assert(many.matches(str) == expected);
+    }
+
+    // readers keep matching on the version they loaded while rules come and go
+    std::atomic<bool> done(false);
+    std::thread reader([&]()
+    {
+        while (!done)
+        {
+            auto found = many.matches("abc");
+            assert(std::is_sorted(found.begin(), found.end()));
+        }
+    });
+    for (unsigned i = 0; i < 20; ++i)
+    {
+        many.remove(many.add("b+c"));
+    }
+    done = true;
+    reader.join();
+    PRTL; assert(many.size() == ids.size() - 12);
+END
+
+TEST(REWRITER)
+    vector<pair<string, string>> rules = { { "\\d{3}-\\d{4}", "<phone>" }, { "\\d+", "<n>" }, { "[a-z]+@[a-z]+", "<mail>" }, { "陈+", "C" } };
+    PRTL; assert(yare::replace_all(rules, "call 555-1234 or 42, ann@mail 陈陈x") == "call <phone> or <n>, <mail> Cx");
+    PRTL; assert(yare::replace_all(rules, "") == "" && yare::replace_all(rules, "none") == "none");
+
+    // overlapping rules: the longest match wins, a tie goes to the earlier rule
+    auto rewriter = yare::Rewriter({ { "ab", "1" }, { "abc", "2" }, { "a|b", "3" }, { "ab", "4" }, { "x*", "5" } });
+    PRTL; assert(rewriter.replace_all("abcabab x") == "211 5");
+
+    // the same as applying every rule at every position by hand
+    vector<yare::Pattern> patterns = { yare::Pattern("ab"), yare::Pattern("abc"), yare::Pattern("a|b"), yare::Pattern("ab"), yare::Pattern("x*") };
+    string alphabet[] = { "a", "b", "c", "x", " " };
+    string names[] = { "1", "2", "3", "4", "5" };
+    PRTL;
+    for (unsigned i = 0; i < 1000; ++i)
+    {
+        auto str = random_text(i, alphabet, 13);
+        string expected;
+        for (size_t pos = 0; pos < str.size();)
+        {
+            size_t best = 0, len = 0;
+            for (size_t k = 0; k < patterns.size(); ++k)
+            {
+                auto res = patterns[k].match(str.substr(pos)).size();
+                if (res > len)
+                {
+                    best = k;
+                    len = res;
+                }
+            }
+            expected += len ? names[best] : str.substr(pos, 1);
+            pos += max<size_t>(len, 1);
+        }
+        assert(rewriter.replace_all(str) == expected);
+    }
+
+    PRTL; assert(yare::replace_all(vector<pair<string, string>>({ { "a*b", "X" } }), string(200000, 'a') + "c") == string(200000, 'a') + "c");
+END
+
+TEST(SPLIT)
+    auto fields = [](yare::Pattern::SplitRange range)
+    {
+        vector<string> res;
+        for (auto field : range)
+        {
+            res.emplace_back(field);
+        }
+        return res;
+    };
+
+    auto pattern = yare::Pattern("\\s*[,;]\\s*");
+    PRTL; assert(fields(pattern.split("a, b;c ,,陈")) == vector<string>({ "a", "b", "c", "", "陈" }));
+    PRTL; assert(fields(pattern.split("")) == vector<string>({ "" }));
+    PRTL; assert(fields(pattern.split(",")) == vector<string>({ "", "" }));
+    PRTL; assert(fields(pattern.splitn("a, b;c", 2)) == vector<string>({ "a", "b;c" }));
+    PRTL; assert(fields(pattern.splitn("a, b;c", 1)) == vector<string>({ "a, b;c" }));
+    PRTL; assert(fields(pattern.splitn("a, b;c", 0)).empty());
+
+    // fields point into the input, nothing is copied
+    string str = "key=value";
+    auto equals = yare::Pattern("=");
+    auto it = equals.split(str).begin();
+    PRTL; assert(it->data() == str.data() && (++it)->data() == str.data() + 4 && *it == "value");
+
+    // the fields and the matches tile the input
+    auto digits = yare::Pattern("\\d+");
+    string text = "a1bb22ccc333";
+    string joined;
+    auto found = digits.matches(text);
+    size_t k = 0;
+    for (auto field : digits.split(text))
+    {
+        joined += string(field) + (k < found.size() ? found[k++] : "");
+    }
+    PRTL; assert(joined == text && k == found.size());
+END
+
+TEST(INCREMENTAL)
+    auto reference = [](const string &pattern, const string &str)
+    {
+        vector<yare::IncrementalMatcher::Match> res;
+        yare::Pattern compiled(pattern);
+        for (auto match : compiled.find_iter(str))
+        {
+            res.push_back({ size_t(match.data() - str.data()), match.size() });
+        }
+        return res;
+    };
+
+    yare::IncrementalMatcher matcher("\\d+", "a1 b22 c333");
+    PRTL; assert(matcher.matches() == reference("\\d+", "a1 b22 c333"));
+    auto changes = matcher.edit(4, 1, "9 9");
+    PRTL; assert(matcher.text() == "a1 b9 92 c333" && matcher.matches() == reference("\\d+", matcher.text()));
+    using Matches = vector<yare::IncrementalMatcher::Match>;
+    PRTL; assert(changes.removed == Matches({ { 4, 2 } }) && changes.added == Matches({ { 4, 1 }, { 6, 2 } }));
+
+    // a run no attempt gets through is read once, and an edit at its end can still turn it into one match
+    yare::IncrementalMatcher run("a*b", string(200000, 'a'));
+    PRTL; assert(run.matches().empty());
+    changes = run.edit(200000, 0, "b");
+    PRTL; assert(changes.removed.empty() && changes.added == Matches({ { 0, 200001 } }) && run.matches() == changes.added);
+
+    // random edits give the same matches as matching the whole text again, and only the changes are reported
+    string alphabet[] = { "a", "b", "c", " ", "陈", "\n" };
+    for (auto pattern : { "ab", "a[^c]*c", "(ab|b)+", "^a", "b$", "[a-c]+ ", "陈|a陈" })
+    {
+        string text;
+        for (unsigned j = 0, seed = 7; j < 3 * yare::IncrementalMatcher::kInterval; ++j, seed = seed * 1103515245u + 12345u)
+        {
+            text += alphabet[(seed >> 8) % 6];
+        }
+        yare::IncrementalMatcher incremental(pattern, text);
+        PRTL;
+        for (unsigned i = 0, seed = 11; i < 200; ++i)
+        {
+            seed = seed * 1103515245u + 12345u;
+            auto pos = (seed >> 4) % (incremental.text().size() + 1);
+            auto removed = (seed >> 20) % 4;
+            string inserted = i % 3 ? alphabet[(seed >> 12) % 6] + alphabet[(seed >> 16) % 6] : "";
+            auto before = incremental.matches();
+            auto edit = incremental.edit(pos, removed, inserted);
+            auto expected = reference(pattern, incremental.text());
+            assert(incremental.matches() == expected);
+            for (const auto &match : edit.removed)
+            {
+                assert(find(before.begin(), before.end(), match) != before.end());
+            }
+            for (const auto &match : edit.added)
+            {
+                assert(find(expected.begin(), expected.end(), match) != expected.end());
+            }
+            assert(before.size() - edit.removed.size() + edit.added.size() == expected.size());
+        }
+    }
+END
+
+TEST(ASYNC)
+    // the simulated NFA agrees with the DFA, and its one pass find with matching at every start
+    for (auto regex : { "a(b|c)*d", "(a|b)*a(a|b){3}", "[^a]+$", "陈+x?", "a{2,3}|b{2}", "(?:<x>ab)(?:<x>)", "", "^a+b?", "a*b$" })
+    {
+        auto str = yare::details::str_to_utf8(regex);
+        yare::details::DFAPtr dfa;
+        bool begin, end;
+        tie(dfa, begin, end) = yare::details::Parse().gen_dfa(str.c_str());
+        yare::details::DFATable table(dfa);
+        yare::details::release(dfa);
+        yare::details::NFASimulator simulator(get<0>(yare::details::Parse().gen_nfa(str.c_str())));
+        string alphabet[] = { "a", "b", "c", "d", "x", "陈" };
+        PRTL; differential(2000, [&](unsigned i) { return random_text(i, alphabet, 11); }, [&](const string &text)
+        {
+            pair<size_t, size_t> found = { string::npos, 0 };
+            for (size_t pos = 0; pos < text.size() && !(begin && pos) && found.first == string::npos;
+                 pos += max<size_t>(1, yare::details::utf8_length(text[pos])))
+            {
+                auto len = table.match(string_view(text).substr(pos), end);
+                found = len && len != string::npos ? make_pair(pos, len) : found;
+            }
+            return make_pair(table.match(text, end), found);
+        }, [&](const string &text) { return make_pair(simulator.match(text, end), simulator.find(text, 0, begin, end)); });
+    }
+    PRTL; assert(yare::Pattern::compile_async("a*b").search(string(200000, 'a')).empty());
+
+    // with $ a start that dies before the end has no match, and a NUL ends every start before it
+    using Span = pair<size_t, size_t>;
+    auto simulator = yare::details::NFASimulator(get<0>(yare::details::Parse().gen_nfa(U"a*b")));
+    PRTL; assert(simulator.find("aab aab", 0, false, true) == Span(4, 3));
+    PRTL; assert(simulator.find("aab aab", 0, false, false) == Span(0, 3));
+    PRTL; assert(simulator.find(string("aa\0ab", 5), 0, false, true) == Span(3, 2));
+    PRTL; assert(simulator.find("aab aab", 1, true, false) == Span(string::npos, 0));
+
+    // answers are the same before and after the swap, the subset construction of this pattern takes a while
+    auto regex = "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)c";
+    auto async = yare::Pattern::compile_async(regex);
+    yare::Pattern pattern(regex);
+    string text = "xxaabbbbbbbbbbcxbaabababababcabbbbbbbbbbbc";
+    PRTL; assert(pattern.matches(text).size() == 2);
+    for (unsigned round = 0; round < 2; ++round)
+    {
+        PRTL; assert(async.match(text.substr(2)) == pattern.match(text.substr(2)));
+        PRTL; assert(async.search(text) == pattern.search(text));
+        PRTL; assert(async.replace(text, "#") == pattern.replace(text, "#"));
+        PRTL; assert(async.matches(text) == pattern.matches(text));
+        async.wait();
+    }
+    PRTL; assert(async.ready());
+    auto anchored = yare::Pattern::compile_async("^ab+");
+    PRTL; assert(anchored.search("abbx") == "abb" && anchored.replace("abbab", "-") == "-ab");
+    PRTL; assert(anchored.wait()->match("abb") == "abb");
+END
+
+TEST(COMPILE_ALL)
+    vector<string> rules = { "\\d+", "[a-z]+@[a-z]+", "\\d+", "陈+", "", "(a|b)*c", "[a-z]+@[a-z]+" };
+    auto results = yare::compile_all(rules);
+    PRTL; assert(results.size() == rules.size());
+    PRTL; assert(results[2].duplicate_of == 0 && results[6].duplicate_of == 1 && results[3].duplicate_of == string::npos);
+    PRTL; assert(results[2].pattern == results[0].pattern && results[2].seconds == 0);
+    for (size_t i = 0; i < rules.size(); ++i)
+    {
+        PRTL; assert(results[i].pattern && results[i].error.empty());
+        PRTL; assert(results[i].pattern->search("mail ann@box 42 陈陈 abac") == yare::search(rules[i], "mail ann@box 42 陈陈 abac"));
+    }
+
+    // any executor will do, also one which runs every task in turn
+    size_t tasks = 0;
+    auto serial = [&](size_t n, const function<void(size_t)> &task)
+    {
+        for (size_t i = 0; i < n; ++i, ++tasks)
+        {
+            task(i);
+        }
+    };
+    results = yare::compile_all(rules.data(), rules.size(), serial);
+    PRTL; assert(tasks == 5 && results[4].pattern->match("") == "");
+    PRTL; assert(yare::compile_all(rules, yare::thread_executor(3))[5].pattern->search("xabbc") == "abbc");
+
+    // malformed patterns get no Pattern and say why, a duplicate says the same
+    results = yare::compile_all({ "(ab", "[a-", "a{3,1}", "*", "a)", "a\\", "(?:<x>ab)(?:<x>)+", "(ab" });
+    vector<string> errors = { "unbalanced ( at character 0", "unterminated [ at character 0", "bad quantifier at character 1",
+        "nothing to repeat at character 0", "unbalanced ) at character 1", "dangling \\ at character 1", "", "unbalanced ( at character 0" };
+    for (size_t i = 0; i < errors.size(); ++i)
+    {
+        PRTL; assert(results[i].error == errors[i] && !results[i].pattern == !errors[i].empty());
+    }
+END
+
+TEST(LAYOUT)
+    auto pattern = yare::Pattern("(GET|POST|PUT) /[a-z/]*(\\?[a-z]+=[0-9]+)? HTTP/1\\.[01]|x{3}y[0-9]+z|陈+阳");
+    auto copy = pattern;
+    vector<string> corpus = { "GET /index/a?id=42 HTTP/1.1", "POST /api HTTP/1.0", "xxxy123z 陈陈阳", "PUT /a/b/c HTTP/1.1" };
+    vector<string_view> views(corpus.begin(), corpus.end());
+
+    auto visits = pattern.profile_states(views.data(), views.size());
+    PRTL; assert(!visits.empty() && visits[0] == 0);
+    auto report = pattern.optimize_layout(visits);
+    PRTL; assert(report.states + 1 == visits.size() && report.hot_states >= 1 && report.hot_states <= report.states);
+    PRTL; assert(report.coverage >= report.coverage_before && report.coverage > 0);
+
+    // renumbering changes no answer, and the hottest state comes first
+    auto after = pattern.profile_states(views.data(), views.size());
+    PRTL; assert(is_sorted(after.begin() + 1, after.end(), greater<uint64_t>()));
+    for (auto str : { "GET /x HTTP/1.1 and POST /y?q=1 HTTP/1.0", "xxxy9z", "陈阳 陈陈", "PUT / HTTP/1.2", "" })
+    {
+        PRTL; assert(pattern.matches(str) == copy.matches(str) && pattern.match(str) == copy.match(str));
+    }
+    PRTL; assert(yare::Pattern("abc|abd").optimize_layout(views.data(), views.size()).states == 0);
+
+    // rows of about 3000 classes, only two fit and the dead state takes the first
+    string wide = "x[";
+    for (unsigned c = 0x4e00; c < 0x4e00 + 3000; c += 2)
+    {
+        wide += { char(0xe0 | c >> 12), char(0x80 | (c >> 6 & 0x3f)), char(0x80 | (c & 0x3f)) };
+    }
+    auto sparse = yare::Pattern(wide + "]+y");
+    report = sparse.optimize_layout(views.data(), views.size());
+    PRTL; assert(report.states > 1 && report.hot_states == 1);
+END
+
+TEST(STATE_WIDTH)
+    PRTL; assert(yare::Pattern("[a-z]+@[a-z]+\\.com").state_width() == 1);
+    PRTL; assert(yare::Pattern("abc|abd").state_width() == 0);
+
+    // 2^9 states need 16 bit numbers, the answers stay the same as with the full table
+    auto regex = "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)";
+    auto pattern = yare::Pattern(regex);
+    PRTL; assert(pattern.state_width() == 2);
+    auto str = yare::details::str_to_utf8(regex);
+    auto dfa = std::get<0>(yare::details::Parse().gen_dfa(str.c_str()));
+    auto table = yare::details::DFATable(dfa);
+    yare::details::release(dfa);
+    PRTL; differential(2000, [](unsigned i) { return random_text(i, string("abc"), 23); }, [&](const string &text)
+    {
+        auto len = table.match(text, false);
+        return len == string::npos ? "" : text.substr(0, len);
+    }, [&](const string &text) { return pattern.match(text); });
+
+    // the last pattern of this family whose states fit in a byte, and the first that needs two
+    PRTL; assert(yare::Pattern("(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)").state_width() == 1);
+    PRTL; assert(yare::Pattern("(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)").state_width() == 2);
+    ASSERT_WP(string(9, 'a'), string(9, 'a'));
+    ASSERT_WP(string(12, 'a') + "c", string(12, 'a'));
+    ASSERT_WP(string(8, 'a'), "");
+    ASSERT_WP(string(9, 'b'), "");
+END
+
+TEST(ALGEBRA)
+    auto words = yare::Pattern("[a-z]+"), digits = yare::Pattern("[0-9]+"), ab = yare::Pattern("ab|abc");
+    auto alnum = words.unite(digits);
+    PRTL; assert(alnum.match("abc1") == "abc" && alnum.match("42x") == "42" && alnum.match("-") == "");
+    PRTL; assert(words.subtract(ab).match("ab") == "a" && words.subtract(ab).match("abd") == "abd");
+    PRTL; assert(words.intersect(yare::Pattern(".*a.*")).search("xyz bab") == "bab");
+    PRTL; assert(words.intersect(digits).is_empty() && !words.is_empty() && yare::Pattern("a").subtract(yare::Pattern("a")).is_empty());
+    PRTL; assert(words.includes(ab) && !ab.includes(words) && alnum.includes(digits) && !digits.includes(alnum));
+    PRTL; assert(alnum.min_length() == 1 && alnum.max_length() == string::npos && ab.intersect(words).max_length() == 3);
+    PRTL; assert(words.intersect(digits).search("abc 123") == "" && !words.intersect(digits).matches_empty());
+
+    // an operand without an anchor the other has counts as having .* there
+    auto starts = yare::Pattern("^a").unite(yare::Pattern("b"));
+    PRTL; assert(starts.anchored() && starts.search("xa") == "" && starts.search("xb") == "xb" && starts.search("ab") == "ab");
+    PRTL; assert(!yare::Pattern("ab$").includes(yare::Pattern("ab")) && yare::Pattern("ab").includes(yare::Pattern("ab$")));
+    PRTL; assert(yare::Pattern("a").includes(yare::Pattern("^a")) && !yare::Pattern("^a").includes(yare::Pattern("a")));
+    PRTL; assert(yare::Pattern("^ab").intersect(yare::Pattern("b")).match("ab") == "ab");
+    PRTL; assert(yare::Pattern("^ab").subtract(yare::Pattern("b")).is_empty());
+
+    // the combined patterns accept what the operands say, on every input
+    vector<yare::Pattern> operands = { yare::Pattern("(ab)*"), yare::Pattern("a[^b]*b?"), yare::Pattern("陈+|b"), yare::Pattern("abc|ba") };
+    string alphabet[] = { "a", "b", "c", "陈" };
+    for (auto &x : operands)
+    {
+        for (auto &y : operands)
+        {
+            auto both = x.intersect(y), either = x.unite(y), only = x.subtract(y);
+            PRTL;
+            for (unsigned i = 0; i < 300; ++i)
+            {
+                auto str = random_text(i, alphabet, 7);
+                bool in_x = x.match(str) == str, in_y = y.match(str) == str;
+                // the empty string is the only one match cannot tell apart from no match
+                if (str.empty())
+                {
+                    continue;
+                }
+                assert((both.match(str) == str) == (in_x && in_y));
+                assert((either.match(str) == str) == (in_x || in_y));
+                assert((only.match(str) == str) == (in_x && !in_y));
+            }
+        }
+    }
+END
+
+TEST(YAREGEN)
+    string out, error;
+    istringstream rules("# a comment line\nword [a-z]+\ntail a\\\\\nclose a*/b\n");
+    PRTL; assert(gen_header(rules, "rules", out, error) && error.empty());
+    PRTL; assert(out.find("namespace rules") != string::npos && out.find("\nword_search(") != string::npos);
+
+    // the patterns are quoted so that no line runs on into the next and no comment closes early
+    PRTL; assert(out.find("/* a\\\\ */") != string::npos && out.find("/* a*\\/b */") != string::npos);
+    istringstream lines(out);
+    for (string line; getline(lines, line);)
+    {
+        assert(line.empty() || line.back() != '\\');
+    }
+
+    // every name ends up as a function name
+    for (auto bad : { "4ever a", "a-b a", "陈 a" })
+    {
+        istringstream in(string("ok a\n") + bad);
+        PRTL; assert(!gen_header(in, "rules", out, error) && error.find("line 2:") == 0);
+    }
+    istringstream in("ok a");
+    PRTL; assert(!gen_header(in, "my rules", out, error) && !error.empty());
+END
+
 // --TEST CHINESE--
 TEST(COMMON_CH)
     ASSERT("6+陈轶阳6+[^苏畅]*6+", "666陈轶阳666", "666陈轶阳666");
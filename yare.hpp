@@ -3,21 +3,259 @@
 
 #include <set>
 #include <map>
+#include <atomic>
 #include <list>
 #include <tuple>
+#include <cctype>
 #include <limits>
+#include <chrono>
 #include <string>
+#include <cstdint>
 #include <vector>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <condition_variable>
 #include <memory>
 #include <utility>
+#include <numeric>
+#include <iterator>
+#include <string_view>
 #include <algorithm>
 #include <functional>
 #include <unordered_map>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__unix__) && !defined(YARE_NO_JIT)
+#define YARE_JIT 1
+#include <sys/mman.h>
+#endif
+
 namespace yare
 {
+// where compiling a pattern spent its time and how big its automata got, alternations of literals skip
+// the automata and only report parse time
+struct CompileStats
+{
+    // wall time of every phase in seconds
+    double parse = 0;
+    double simplify = 0;
+    double thompson = 0;
+    double subset = 0;
+    double minimize = 0;
+    double table = 0;
+
+    std::size_t nfa_states = 0;
+    std::size_t dfa_states = 0;
+    std::size_t minimized_states = 0;
+    std::size_t classes = 0;
+    // estimated bytes of the automata alive at the same time, at worst
+    std::size_t peak_memory = 0;
+    // how many compilations are added up
+    std::size_t patterns = 0;
+
+    double
+    total() const
+    {
+        return parse + simplify + thompson + subset + minimize + table;
+    }
+
+    // sums the stats of many patterns, peak_memory becomes the largest peak of any of them
+    CompileStats &
+    operator+=(const CompileStats &other)
+    {
+        parse += other.parse;
+        simplify += other.simplify;
+        thompson += other.thompson;
+        subset += other.subset;
+        minimize += other.minimize;
+        table += other.table;
+        nfa_states += other.nfa_states;
+        dfa_states += other.dfa_states;
+        minimized_states += other.minimized_states;
+        classes += other.classes;
+        peak_memory = std::max(peak_memory, other.peak_memory);
+        patterns += other.patterns;
+        return *this;
+    }
+};
+
+// counters of a Pattern since it was compiled, all zero unless YARE_TELEMETRY is defined;
+// calls are the calls of match, search, replace, matches, count and the batch methods
+struct TelemetrySnapshot
+{
+    static constexpr std::size_t kBuckets = 24;
+
+    std::uint64_t calls = 0;
+    std::uint64_t bytes = 0;
+    std::uint64_t matches = 0;
+    // searches the required literal let through, and the ones it ended because the literal was not there
+    std::uint64_t prefilter_hits = 0;
+    std::uint64_t prefilter_misses = 0;
+    // latency[i] counts calls which took [2^i, 2^(i + 1)) nanoseconds, the last bucket also longer ones
+    std::uint64_t latency[kBuckets] = {};
+
+    TelemetrySnapshot &
+    operator+=(const TelemetrySnapshot &other)
+    {
+        calls += other.calls;
+        bytes += other.bytes;
+        matches += other.matches;
+        prefilter_hits += other.prefilter_hits;
+        prefilter_misses += other.prefilter_misses;
+        for (std::size_t i = 0; i < kBuckets; ++i)
+        {
+            latency[i] += other.latency[i];
+        }
+        return *this;
+    }
+};
+
 namespace details
 {
+// seconds since the previous lap
+class Stopwatch
+{
+  private:
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+  public:
+    double
+    lap()
+    {
+        auto now = std::chrono::steady_clock::now();
+        auto seconds = std::chrono::duration<double>(now - last).count();
+        last = now;
+        return seconds;
+    }
+};
+
+#if defined(YARE_TELEMETRY)
+// counters striped over a few cache lines, every thread sticks to one of them and adds with relaxed atomics
+class Telemetry
+{
+  private:
+    static constexpr std::size_t kSlots = 4;
+
+    struct alignas(64) Slot
+    {
+        std::atomic<std::uint64_t> calls{ 0 };
+        std::atomic<std::uint64_t> bytes{ 0 };
+        std::atomic<std::uint64_t> matches{ 0 };
+        std::atomic<std::uint64_t> prefilter_hits{ 0 };
+        std::atomic<std::uint64_t> prefilter_misses{ 0 };
+        std::atomic<std::uint64_t> latency[TelemetrySnapshot::kBuckets]{};
+    };
+
+    Slot slots[kSlots];
+
+    Slot &
+    slot()
+    {
+        static std::atomic<std::size_t> threads{ 0 };
+        thread_local std::size_t index = threads.fetch_add(1, std::memory_order_relaxed) % kSlots;
+        return slots[index];
+    }
+
+  public:
+    void
+    call(std::uint64_t nanoseconds)
+    {
+        std::size_t bucket = 0;
+        while (bucket + 1 < TelemetrySnapshot::kBuckets && nanoseconds >> (bucket + 1))
+        {
+            ++bucket;
+        }
+        auto &slot = this->slot();
+        slot.calls.fetch_add(1, std::memory_order_relaxed);
+        slot.latency[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void
+    scan(std::uint64_t bytes, std::uint64_t matches)
+    {
+        auto &slot = this->slot();
+        slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        slot.matches.fetch_add(matches, std::memory_order_relaxed);
+    }
+
+    void
+    prefilter(bool hit)
+    {
+        (hit ? slot().prefilter_hits : slot().prefilter_misses).fetch_add(1, std::memory_order_relaxed);
+    }
+
+    TelemetrySnapshot
+    snapshot() const
+    {
+        TelemetrySnapshot res;
+        for (const auto &slot : slots)
+        {
+            res.calls += slot.calls.load(std::memory_order_relaxed);
+            res.bytes += slot.bytes.load(std::memory_order_relaxed);
+            res.matches += slot.matches.load(std::memory_order_relaxed);
+            res.prefilter_hits += slot.prefilter_hits.load(std::memory_order_relaxed);
+            res.prefilter_misses += slot.prefilter_misses.load(std::memory_order_relaxed);
+            for (std::size_t i = 0; i < TelemetrySnapshot::kBuckets; ++i)
+            {
+                res.latency[i] += slot.latency[i].load(std::memory_order_relaxed);
+            }
+        }
+        return res;
+    }
+};
+
+// times a call from its construction to its destruction
+class Probe
+{
+  private:
+    Telemetry *telemetry;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  public:
+    explicit Probe(Telemetry *telemetry) : telemetry(telemetry) {}
+
+    ~Probe()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        telemetry->call(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+
+    Probe(const Probe &) = delete;
+    Probe &operator=(const Probe &) = delete;
+};
+
+inline void
+record_scan(Telemetry *telemetry, std::size_t bytes, std::size_t matches)
+{
+    telemetry->scan(bytes, matches);
+}
+
+inline void
+record_prefilter(Telemetry *telemetry, bool hit)
+{
+    telemetry->prefilter(hit);
+}
+#else
+// telemetry is compiled out, so is everything which records into it
+class Telemetry;
+
+class Probe
+{
+  public:
+    explicit Probe(Telemetry *) {}
+};
+
+inline void
+record_scan(Telemetry *, std::size_t, std::size_t) {}
+
+inline void
+record_prefilter(Telemetry *, bool) {}
+#endif
+
 constexpr char32_t kChar32Min = std::numeric_limits<char32_t>::min();
 constexpr char32_t kChar32Max = std::numeric_limits<char32_t>::max();
 
@@ -93,6 +331,57 @@ utf8_to_str(const std::u32string &str)
     return result;
 }
 
+// byte length of a character as str_to_utf8 packs it
+inline std::size_t
+utf8_bytes(char32_t chr)
+{
+    return chr < 1U << 8 ? 1 : chr < 1U << 16 ? 2 : chr < 1U << 24 ? 3 : 4;
+}
+
+// byte length of the character led by lead, 0 for bytes str_to_utf8 stops at
+inline std::size_t
+utf8_length(unsigned char lead)
+{
+    return lead < 0b10000000U ? 1
+         : lead < 0b11100000U ? 2
+         : lead < 0b11110000U ? 3
+         : lead < 0b11111000U ? 4
+         : 0;
+}
+
+// reads one character in the same packed form as str_to_utf8, returns false where str_to_utf8 would stop
+inline bool
+read_utf8(const unsigned char *&reading, const unsigned char *last, char32_t &chr)
+{
+    if (reading == last || !*reading)
+    {
+        return false;
+    }
+
+    auto size = utf8_length(*reading);
+    if (!size || static_cast<std::size_t>(last - reading) < size)
+    {
+        return false;
+    }
+
+    chr = *reading++;
+    while (--size)
+    {
+        (chr <<= 8) |= *reading++;
+    }
+    return true;
+}
+
+inline void
+prefetch(const void *addr)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(addr);
+#else
+    (void)addr;
+#endif
+}
+
 using Scope  = std::pair<char32_t, char32_t>;
 using NFAPtr = std::shared_ptr<struct NFAState>;
 using DFAPtr = std::shared_ptr<struct DFAState>;
@@ -214,8 +503,13 @@ struct DFAState
         NORMAL, END
     };
 
+    static constexpr std::size_t kNoToken = std::numeric_limits<std::size_t>::max();
+
     State state;
     std::map<Scope, DFAPtr> scope_state;
+    // for an END state, the first of the NFA ends given to to_dfa which it accepts, and all of the first 64
+    std::size_t token = kNoToken;
+    std::uint64_t mask = 0;
 
     DFAState() : state(State::NORMAL) {}
     DFAState(State state) : state(state) {}
@@ -269,6 +563,27 @@ struct DFAState
     }
 };
 
+// breaks the shared_ptr cycles of a DFA graph, so that it is freed with its last outside reference
+inline void
+release(const DFAPtr &dfa)
+{
+    std::vector<DFAPtr> pending = { dfa }, owned;
+    while (!pending.empty())
+    {
+        auto state = pending.back();
+        pending.pop_back();
+        for (auto &scope_s : state->scope_state)
+        {
+            if (!scope_s.second->scope_state.empty() && scope_s.second != state)
+            {
+                pending.push_back(scope_s.second);
+            }
+            owned.push_back(std::move(scope_s.second));
+        }
+        state->scope_state.clear();
+    }
+}
+
 class NFAPair
 {
   public:
@@ -278,66 +593,226 @@ class NFAPair
     NFAPair() : start(std::make_shared<NFAState>()), end(std::make_shared<NFAState>()) {}
     NFAPair(std::shared_ptr<NFAState> start, std::shared_ptr<NFAState> end) : start(start), end(end) {}
 
-    DFAPtr to_dfa()
+    // stats, if given, gets the subset and minimization phases
+    DFAPtr to_dfa(CompileStats *stats = nullptr)
     {
-        auto q0 = eps_closure({ start });
-        std::vector<std::set<NFAPtr>> Q = {q0};
-        std::list<std::set<NFAPtr>> work_list= {q0};
-        std::vector<DFAPtr> mp = {std::make_shared<DFAState>(
-            (std::find(q0.begin(), q0.end(), end) != q0.end())
-            ? DFAState::State::END
-            : DFAState::State::NORMAL
-        )};
+        return to_dfa({ end }, stats);
+    }
 
-        while (!work_list.empty())
+    // a DFA accepting wherever any of ends is reached, its END states keep the index of the first end
+    // they accept as token and the ends they accept as mask, so states accepting different ends are never merged
+    DFAPtr to_dfa(const std::vector<NFAPtr> &ends, CompileStats *stats)
+    {
+        Stopwatch watch;
+
+        // number the reachable states, only the ones with a character edge and the end stay in subsets
+        std::vector<NFAState *> states;
+        std::unordered_map<NFAState *, std::uint32_t> ids;
+        std::vector<NFAState *> stack = { start.get() };
+        ids[start.get()] = 0;
+        while (!stack.empty())
         {
-            auto q = work_list.back();
-            work_list.pop_back();
-
-            for (auto scope : cal_scopes(q))
+            auto state = stack.back();
+            stack.pop_back();
+            states.push_back(state);
+            for (auto next : { state->next.get(), state->next2.get() })
             {
-                auto t = eps_closure(delta(q, scope));
-                if (t.empty())
+                if (next && ids.emplace(next, 0).second)
                 {
-                    continue;
+                    stack.push_back(next);
                 }
+            }
+        }
+        for (std::uint32_t id = 0; id < states.size(); ++id)
+        {
+            ids[states[id]] = id;
+        }
+
+        std::vector<std::size_t> tokens(states.size(), DFAState::kNoToken);
+        for (std::size_t i = ends.size(); i--;)
+        {
+            auto it = ids.find(ends[i].get());
+            if (it != ids.end())
+            {
+                tokens[it->second] = i;
+            }
+        }
 
-                for (std::size_t i = 0, j = 0; i < Q.size(); ++i)
+        // epsilon closures as sorted id lists, computed once per state which starts one
+        std::vector<std::vector<std::uint32_t>> closures(states.size());
+        std::vector<bool> closed(states.size(), false);
+        std::vector<std::uint32_t> visits(states.size(), 0), marks(states.size(), 0);
+        std::uint32_t visit = 0, mark = 0;
+        auto closure_of = [&](std::uint32_t id) -> const std::vector<std::uint32_t> &
+        {
+            if (!closed[id])
+            {
+                auto &closure = closures[id];
+                std::vector<std::uint32_t> pending = { id };
+                visits[id] = ++visit;
+                while (!pending.empty())
                 {
-                    if (Q[i] == q)
+                    auto state = states[pending.back()];
+                    if (state->edge_type == NFAState::EdgeType::CCL || tokens[pending.back()] != DFAState::kNoToken)
                     {
-                        while (j < Q.size())
+                        closure.push_back(pending.back());
+                    }
+                    pending.pop_back();
+                    if (state->edge_type == NFAState::EdgeType::EPSILON)
+                    {
+                        for (auto next : { state->next.get(), state->next2.get() })
                         {
-                            if (Q[j] == t)
-                            {
-                                mp[i]->scope_state[scope] = mp[j];
-                                break;
-                            }
-                            else
+                            if (next && visits[ids[next]] != visit)
                             {
-                                ++j;
+                                visits[ids[next]] = visit;
+                                pending.push_back(ids[next]);
                             }
                         }
+                    }
+                }
+                std::sort(closure.begin(), closure.end());
+                closed[id] = true;
+            }
+            return closures[id];
+        };
 
-                        if (j == Q.size())
-                        {
-                            Q.push_back(t);
-                            work_list.push_back(t);
-                            mp.push_back(std::make_shared<DFAState>(
-                                (std::find(t.begin(), t.end(), end) != t.end())
-                                ? DFAState::State::END
-                                : DFAState::State::NORMAL
-                            ));
-                            mp[i]->scope_state[scope] = mp.back();
-                        }
+        // union of the closures of targets, a sorted id list again
+        auto close = [&](const std::vector<std::uint32_t> &targets)
+        {
+            std::vector<std::uint32_t> subset;
+            ++mark;
+            for (auto target : targets)
+            {
+                for (auto id : closure_of(target))
+                {
+                    if (marks[id] != mark)
+                    {
+                        marks[id] = mark;
+                        subset.push_back(id);
+                    }
+                }
+            }
+            std::sort(subset.begin(), subset.end());
+            return subset;
+        };
+
+        auto make_state = [&](const std::vector<std::uint32_t> &subset)
+        {
+            auto token = DFAState::kNoToken;
+            std::uint64_t mask = 0;
+            for (auto id : subset)
+            {
+                token = std::min(token, tokens[id]);
+                if (tokens[id] < 64)
+                {
+                    mask |= std::uint64_t(1) << tokens[id];
+                }
+            }
+            auto state = std::make_shared<DFAState>(token == DFAState::kNoToken
+                ? DFAState::State::NORMAL
+                : DFAState::State::END);
+            state->token = token;
+            state->mask = mask;
+            return state;
+        };
+
+        std::vector<std::vector<std::uint32_t>> Q = { close({ 0 }) };
+        std::map<std::vector<std::uint32_t>, std::size_t> index = { { Q[0], 0 } };
+        std::vector<std::size_t> work_list = { 0 };
+        std::vector<DFAPtr> mp = { make_state(Q[0]) };
+
+        while (!work_list.empty())
+        {
+            auto i = work_list.back();
+            work_list.pop_back();
+
+            std::vector<Scope> scopes;
+            for (auto id : Q[i])
+            {
+                scopes.insert(scopes.end(), states[id]->scopes.begin(), states[id]->scopes.end());
+            }
+            scopes = cal_scopes(scopes);
 
-                        break;
+            // cal_scopes splits into disjoint sorted pieces, every scope of a state covers a run of them
+            std::vector<std::vector<std::uint32_t>> targets(scopes.size());
+            for (auto id : Q[i])
+            {
+                auto state = states[id];
+                if (state->edge_type != NFAState::EdgeType::CCL)
+                {
+                    continue;
+                }
+                for (const auto &scope : state->scopes)
+                {
+                    auto k = std::lower_bound(scopes.begin(), scopes.end(), scope.first,
+                        [](const Scope &piece, char32_t chr) { return piece.second < chr; }) - scopes.begin();
+                    for (; k < static_cast<std::ptrdiff_t>(scopes.size()) && scopes[k].first <= scope.second; ++k)
+                    {
+                        targets[k].push_back(ids[state->next.get()]);
                     }
                 }
             }
+
+            for (std::size_t k = 0; k < scopes.size(); ++k)
+            {
+                auto t = close(targets[k]);
+                if (t.empty())
+                {
+                    continue;
+                }
+
+                auto found = index.find(t);
+                if (found == index.end())
+                {
+                    found = index.insert({ t, Q.size() }).first;
+                    work_list.push_back(Q.size());
+                    mp.push_back(make_state(t));
+                    Q.push_back(std::move(t));
+                }
+                mp[i]->scope_state[scopes[k]] = mp[found->second];
+            }
+        }
+
+        std::size_t dfa_bytes = 0;
+        if (stats)
+        {
+            std::size_t nfa_bytes = 0;
+            for (auto state : states)
+            {
+                nfa_bytes += sizeof(NFAState) + state->scopes.size() * (sizeof(Scope) + 4 * sizeof(void *));
+            }
+            std::size_t subset_bytes = 0;
+            for (std::size_t i = 0; i < mp.size(); ++i)
+            {
+                // a subset is kept twice, as Q[i] and as a key of index
+                subset_bytes += 2 * Q[i].capacity() * sizeof(std::uint32_t);
+                dfa_bytes += sizeof(DFAState) + mp[i]->scope_state.size() * (sizeof(Scope) + sizeof(DFAPtr) + 4 * sizeof(void *));
+            }
+            stats->nfa_states = states.size();
+            stats->dfa_states = mp.size();
+            stats->peak_memory = std::max(stats->peak_memory, nfa_bytes + subset_bytes + dfa_bytes);
+            stats->subset = watch.lap();
+        }
+
+        // the NFA is consumed, break its cycles so that it is freed
+        {
+            std::vector<NFAPtr> owned;
+            for (auto state : states)
+            {
+                owned.push_back(std::move(state->next));
+                owned.push_back(std::move(state->next2));
+            }
         }
 
-        return dfa_minimization(mp);
+        auto dfa = dfa_minimization(mp, stats);
+        if (stats)
+        {
+            stats->minimize = watch.lap();
+            // the minimized graph is built next to mp, with about as many edges per state
+            stats->peak_memory = std::max(stats->peak_memory,
+                dfa_bytes * (stats->minimized_states + stats->dfa_states) / std::max<std::size_t>(1, stats->dfa_states));
+        }
+        return dfa;
     }
 
   private:
@@ -403,6 +878,11 @@ class NFAPair
                 }
                 result.push_back({ start, it->first });
                 --left;
+                // nothing follows the last character, and start would wrap around
+                if (it->first == kChar32Max)
+                {
+                    break;
+                }
                 if (left > 0)
                 {
                     start = it->first + 1;
@@ -413,19 +893,6 @@ class NFAPair
         return result;
     }
 
-    std::vector<Scope> cal_scopes(const std::set<NFAPtr> &q)
-    {
-        std::vector<Scope> temp;
-        for (auto &state : q)
-        {
-            for (auto &scope : state->scopes)
-            {
-                temp.push_back(scope);
-            }
-        }
-        return cal_scopes(temp);
-    }
-
     std::vector<Scope> cal_scopes(const std::set<DFAPtr> &q)
     {
         std::vector<Scope> temp;
@@ -439,49 +906,8 @@ class NFAPair
         return cal_scopes(temp);
     }
 
-    void add2rS(std::set<NFAPtr> &rS, const NFAPtr &s)
-    {
-        rS.insert(s);
-        if (s->edge_type == NFAState::EdgeType::EPSILON)
-        {
-            if (!rS.count(s->next))
-            {
-                add2rS(rS, s->next);
-            }
-            if (s->next2 && !rS.count(s->next2))
-            {
-                add2rS(rS, s->next2);
-            }
-        }
-    }
-
-    std::set<NFAPtr>
-    eps_closure(const std::set<NFAPtr> &S)
-    {
-        std::set<NFAPtr> rS;
-        for (auto &s: S)
-        {
-            add2rS(rS, s);
-        }
-        return rS;
-    }
-
-    std::set<NFAPtr>
-    delta(std::set<NFAPtr> &q, const Scope &scope)
-    {
-        std::set<NFAPtr> rq;
-        for (auto &s : q)
-        {
-            if (s->edge_type == NFAState::EdgeType::CCL && s->contains_scope(scope))
-            {
-                rq.insert(s->next);
-            }
-        }
-        return rq;
-    }
-
     DFAPtr
-    dfa_minimization(std::vector<DFAPtr> &mp)
+    dfa_minimization(std::vector<DFAPtr> &mp, CompileStats *stats)
     {
         std::set<std::set<int>> T, P;
 
@@ -498,14 +924,20 @@ class NFAPair
         };
 
         {
-            std::vector<std::set<int>> _T = {{}, {}};
+            // the normal states, and the END states of every token and set of ends
+            std::map<std::pair<std::size_t, std::uint64_t>, std::set<int>> _T;
 
             for (std::size_t i = 0; i < mp.size(); ++i)
             {
-                _T[mp[i]->state == DFAState::State::END].insert(i);
+                _T[mp[i]->state == DFAState::State::END
+                    ? std::make_pair(mp[i]->token, mp[i]->mask)
+                    : std::make_pair(DFAState::kNoToken, std::uint64_t(0))].insert(i);
             }
 
-            T.insert(_T[0]); T.insert(_T[1]);
+            for (auto &part : _T)
+            {
+                T.insert(part.second);
+            }
         }
 
         auto split = [&](const std::set<int> &S)
@@ -606,6 +1038,8 @@ class NFAPair
                     if (mp[k]->state == DFAState::State::END)
                     {
                         states[i]->state = DFAState::State::END;
+                        states[i]->token = mp[k]->token;
+                        states[i]->mask = mp[k]->mask;
                     }
                     if (k == 0)
                     {
@@ -618,781 +1052,5863 @@ class NFAPair
                 }
             }
         }
+
+        for (auto &state : mp)
+        {
+            state->scope_state.clear();
+        }
+        if (stats)
+        {
+            stats->minimized_states = states.size();
+        }
         return start;
     }
 };
 
-class Node
-{
-  public:
-    virtual ~Node() {}
-
-    virtual std::shared_ptr<NFAPair>
-    compile() = 0;
-};
-
-class LeafNode : public Node
+// the ascii bytes on which a state loops back to itself, as a few byte ranges which can be tested 16 or 32 at a time
+struct SelfLoop
 {
-  private:
-    char32_t leaf;
+    static constexpr std::size_t kMaxRanges = 4;
 
-  public:
-    LeafNode(char32_t c) : leaf(c) {}
+    std::uint64_t bits[2] = { 0, 0 };
+    unsigned char lo[kMaxRanges], hi[kMaxRanges];
+    std::size_t ranges = 0;
 
-    virtual std::shared_ptr<NFAPair>
-    compile()
+    bool
+    contains(unsigned char chr) const
     {
-        auto ptr = std::make_shared<NFAPair>();
-
-        ptr->start->edge_type = NFAState::EdgeType::CCL;
-        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
-        ptr->start->next = ptr->end;
-        ptr->start->scopes.insert({ leaf, leaf });
-
-        return ptr;
+        return chr < 128 && (bits[chr >> 6] >> (chr & 63) & 1);
     }
-};
-
-class CatNode : public Node
-{
-  private:
-    std::shared_ptr<Node> left;
-    std::shared_ptr<Node> right;
-
-  public:
-    CatNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right) : left(left), right(right) {}
 
-    virtual std::shared_ptr<NFAPair>
-    compile()
+    // first byte in [reading, last) which leaves the loop
+    const unsigned char *
+    skip(const unsigned char *reading, const unsigned char *last) const
     {
-        auto left = this->left->compile();
-        auto right = this->right->compile();
-        auto ptr = std::make_shared<NFAPair>(left->start, right->end);
-
-        left->end->edge_type = NFAState::EdgeType::EPSILON;
-        left->end->next = right->start;
-
-        return ptr;
+#if defined(__AVX2__)
+        while (last - reading >= 32)
+        {
+            auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(reading));
+            auto in = _mm256_setzero_si256();
+            for (std::size_t k = 0; k < ranges; ++k)
+            {
+                // chr - lo <= hi - lo as unsigned bytes
+                auto shifted = _mm256_sub_epi8(chunk, _mm256_set1_epi8(static_cast<char>(lo[k])));
+                auto width = _mm256_set1_epi8(static_cast<char>(hi[k] - lo[k]));
+                in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, width), shifted));
+            }
+            auto mask = ~static_cast<std::uint32_t>(_mm256_movemask_epi8(in));
+            if (mask)
+            {
+                return reading + __builtin_ctz(mask);
+            }
+            reading += 32;
+        }
+#endif
+#if defined(__SSE2__)
+        while (last - reading >= 16)
+        {
+            auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(reading));
+            auto in = _mm_setzero_si128();
+            for (std::size_t k = 0; k < ranges; ++k)
+            {
+                auto shifted = _mm_sub_epi8(chunk, _mm_set1_epi8(static_cast<char>(lo[k])));
+                auto width = _mm_set1_epi8(static_cast<char>(hi[k] - lo[k]));
+                in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(shifted, width), shifted));
+            }
+            auto mask = ~static_cast<unsigned>(_mm_movemask_epi8(in)) & 0xFFFFU;
+            if (mask)
+            {
+                return reading + __builtin_ctz(mask);
+            }
+            reading += 16;
+        }
+#endif
+        while (reading != last && contains(*reading))
+        {
+            ++reading;
+        }
+        return reading;
     }
 };
 
-class SelectNode : public Node
+class DFATable
 {
-  private:
-    std::shared_ptr<Node> left;
-    std::shared_ptr<Node> right;
-
   public:
-    SelectNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right) : left(left), right(right) {}
-
-    virtual std::shared_ptr<NFAPair>
-    compile()
-    {
-        auto left = this->left->compile();
-        auto right = this->right->compile();
-        auto ptr = std::make_shared<NFAPair>();
+    static constexpr std::uint32_t kDead = 0;
+    // self loops on fewer bytes are not worth leaving the plain table walk for
+    static constexpr std::size_t kMinLoopBytes = 4;
+    // search walks from one start after another while they read at most kWalkCredit bytes plus kWalkFactor
+    // per start in all, and looks for a thread in the same state by going through up to kLinearThreads
+    static constexpr std::size_t kWalkCredit = 256;
+    static constexpr std::size_t kWalkFactor = 8;
+    static constexpr std::size_t kLinearThreads = 16;
+
+    std::uint32_t start;
+    std::size_t classes;
+    // next[state * classes + class_of(chr)], the dead state 0 only leads to itself
+    std::vector<std::uint32_t> next;
+    std::vector<std::uint8_t> accept;
+    // loops[state].ranges is 0 unless the state is worth skipping through
+    std::vector<SelfLoop> loops;
+    // tokens[state] and masks[state] of the accepting states, only filled for a table built with_tokens
+    std::vector<std::uint32_t> tokens;
+    std::vector<std::uint64_t> masks;
 
-        ptr->start->edge_type = NFAState::EdgeType::EPSILON;
-        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
-        ptr->start->next = left->start;
-        ptr->start->next2 = right->start;
-
-        left->end->edge_type = NFAState::EdgeType::EPSILON;
-        right->end->edge_type = NFAState::EdgeType::EPSILON;
-        left->end->next = ptr->end;
-        right->end->next = ptr->end;
-
-        return ptr;
-    }
-};
-
-class ClosureNode : public Node
-{
   private:
-    std::shared_ptr<Node> content;
-
-  public:
-    ClosureNode(std::shared_ptr<Node> content) : content(content) {}
+    std::uint32_t ascii[128];
+    // bounds[k] is the smallest character of class k
+    std::vector<char32_t> bounds;
 
-    virtual std::shared_ptr<NFAPair>
-    compile()
+    struct Unvisited
     {
-        auto content = this->content->compile();
-        auto ptr = std::make_shared<NFAPair>();
-
-        ptr->start->edge_type = NFAState::EdgeType::EPSILON;
-        ptr->start->next = content->start;
-        ptr->start->next2 = ptr->end;
-        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
-
-        content->end->edge_type = NFAState::EdgeType::EPSILON;
-        content->end->next = content->start;
-        content->end->next2 = ptr->end;
-
-        return ptr;
-    }
-};
-
-class QualifierNode : public Node
-{
-  private:
-    std::shared_ptr<Node> content;
-    int n;
-    int m;
-
-  public:
-
-    QualifierNode(std::shared_ptr<Node> content, int n, int m) : content(content), n(n), m(m) {}
+        void operator()(std::uint32_t, std::size_t) const {}
+    };
 
-    virtual std::shared_ptr<NFAPair>
-    compile()
+    // the table walk behind longest, resume and the end of search: reads from state at reading through
+    // transitions, calling accepted(end, state) whenever a prefix is accepted and visit(state, bytes) for the
+    // bytes read in a state, including the one which ends the walk; returns where it stopped, state is kDead
+    // there if the last character led nowhere and is still alive if the input ended
+    template <typename StateId, typename Accepted, typename Visit>
+    const unsigned char *
+    walk(const StateId *transitions, const unsigned char *reading, const unsigned char *last, std::uint32_t &state,
+         const Accepted &accepted, const Visit &visit) const
     {
-        auto ptr = std::make_shared<NFAPair>();
-        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
-
-        // -2 means '{n}', -1 means '{n,}', >=0 means '{n,m}'
-        if (m == -2) // for '{n}'
+        char32_t chr;
+        for (;;)
         {
-            std::shared_ptr<Node> temp = (n > 0) ? content : nullptr;
-            for (int i = 1; i < n; ++i)
+            auto skipped = loops[state].ranges ? loops[state].skip(reading, last) : reading;
+            if (skipped != reading && accept[state])
             {
-                temp = std::make_shared<CatNode>(temp, content);
+                accepted(skipped, state);
             }
-            if (temp)
+            visit(state, skipped - reading + 1);
+            reading = skipped;
+
+            if (!read_utf8(reading, last, chr) || (state = transitions[state * classes + class_of(chr)]) == kDead)
             {
-                return temp->compile();
+                return reading;
             }
-            else
+            if (accept[state])
             {
-                ptr->start->edge_type = NFAState::EdgeType::EPSILON;
-                ptr->start->next = ptr->end;
+                accepted(reading, state);
             }
         }
-        else if (m == -1) // for '{n,}'
+    }
+
+    template <std::size_t Lanes>
+    struct LaneSet
+    {
+        const unsigned char *first[Lanes], *reading[Lanes], *last[Lanes];
+        std::uint32_t state[Lanes];
+        std::size_t res[Lanes];
+        std::size_t index[Lanes];
+    };
+
+  public:
+    DFATable(const DFAPtr &dfa, bool with_tokens = false)
+    {
+        std::vector<const DFAState *> states = { nullptr, dfa.get() };
+        std::unordered_map<const DFAState *, std::uint32_t> ids = { { dfa.get(), 1 } };
+        std::set<char32_t> marks = { kChar32Min };
+
+        for (std::size_t i = 1; i < states.size(); ++i)
         {
-            std::shared_ptr<Node> temp = (n > 0) ? content : nullptr;
-            for (int i = 1; i < n; ++i)
+            for (const auto &scope_s : states[i]->scope_state)
             {
-                temp = std::make_shared<CatNode>(temp, content);
+                marks.insert(scope_s.first.first);
+                if (scope_s.first.second != kChar32Max)
+                {
+                    marks.insert(scope_s.first.second + 1);
+                }
+                if (ids.insert({ scope_s.second.get(), static_cast<std::uint32_t>(states.size()) }).second)
+                {
+                    states.push_back(scope_s.second.get());
+                }
             }
-            return temp
-                   ? std::make_shared<CatNode>(temp, std::make_shared<ClosureNode>(content))->compile()
-                   : std::make_shared<ClosureNode>(content)->compile();
         }
-        else if (n < m && n >= 0) // for '{n,m}'
+
+        bounds.assign(marks.begin(), marks.end());
+        for (char32_t chr = 0; chr < 128; ++chr)
         {
-            auto first = content->compile();
-            auto pre = first;
-            ptr->start->edge_type = NFAState::EdgeType::EPSILON;
-            ptr->start->next = first->start;
-            if (n == 0)
+            ascii[chr] = std::upper_bound(bounds.begin(), bounds.end(), chr) - bounds.begin() - 1;
+        }
+
+        start = 1;
+        classes = bounds.size();
+        next.assign(states.size() * classes, kDead);
+        accept.assign(states.size(), false);
+
+        if (with_tokens)
+        {
+            tokens.assign(states.size(), 0);
+            masks.assign(states.size(), 0);
+        }
+        for (std::size_t i = 1; i < states.size(); ++i)
+        {
+            accept[i] = states[i]->state == DFAState::State::END;
+            if (with_tokens && accept[i])
             {
-                ptr->start->next2 = ptr->end;
+                tokens[i] = states[i]->token;
+                masks[i] = states[i]->mask;
             }
-
-            for (int i = 1; i < m; ++i)
+            for (const auto &scope_s : states[i]->scope_state)
             {
-                auto now = content->compile();
-                pre->end->edge_type = NFAState::EdgeType::EPSILON;
-                pre->end->next = now->start;
-                if (i > n - 2)
+                auto target = ids[scope_s.second.get()];
+                for (auto k = class_of(scope_s.first.first); k <= class_of(scope_s.first.second); ++k)
                 {
-                    pre->end->next2 = ptr->end;
+                    next[i * classes + k] = target;
                 }
-                pre = now;
             }
+        }
 
-            pre->end->edge_type = NFAState::EdgeType::EPSILON;
-            pre->end->next = ptr->end;
+        loops.resize(states.size());
+        for (std::size_t i = 1; i < states.size(); ++i)
+        {
+            SelfLoop loop;
+            std::size_t bytes = 0;
+            // nul ends every match, so it never belongs to a loop
+            for (unsigned chr = 1; chr < 128; ++chr)
+            {
+                if (next[i * classes + ascii[chr]] != i)
+                {
+                    continue;
+                }
+                ++bytes;
+                loop.bits[chr >> 6] |= std::uint64_t(1) << (chr & 63);
+                if (loop.ranges && loop.ranges <= SelfLoop::kMaxRanges && loop.hi[loop.ranges - 1] + 1U == chr)
+                {
+                    loop.hi[loop.ranges - 1] = chr;
+                }
+                else if (++loop.ranges <= SelfLoop::kMaxRanges)
+                {
+                    loop.lo[loop.ranges - 1] = loop.hi[loop.ranges - 1] = chr;
+                }
+            }
+            if (bytes >= kMinLoopBytes && loop.ranges <= SelfLoop::kMaxRanges)
+            {
+                loops[i] = loop;
+            }
         }
-        else
+    }
+
+    std::size_t
+    class_of(char32_t chr) const
+    {
+        if (chr < 128)
         {
-            ptr->start->edge_type = NFAState::EdgeType::EPSILON;
-            ptr->start->next = ptr->end;
+            return ascii[chr];
         }
+        return std::upper_bound(bounds.begin(), bounds.end(), chr) - bounds.begin() - 1;
+    }
 
-        return ptr;
+    std::size_t
+    states() const
+    {
+        return accept.size();
     }
-};
 
-class DotNode : public Node
-{
-  public:
-    virtual std::shared_ptr<NFAPair>
-    compile()
+    // the characters of class k
+    Scope
+    class_scope(std::size_t k) const
     {
-        auto ptr = std::make_shared<NFAPair>();
+        return { bounds[k], k + 1 < bounds.size() ? bounds[k + 1] - 1 : kChar32Max };
+    }
 
-        ptr->start->edge_type = NFAState::EdgeType::CCL;
-        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
-        ptr->start->next = ptr->end;
-        ptr->start->scopes.insert({ kChar32Min, 31ULL });
-        ptr->start->scopes.insert({ 33ULL, kChar32Max });
+    // byte length of the longest accepted prefix of str, npos if there is none
+    std::size_t
+    match(std::string_view str, bool end) const
+    {
+        return resume(str, 0, start, accept[start] ? 0 : std::string_view::npos, end);
+    }
 
-        return ptr;
+    // character count of the longest accepted prefix of a nul-terminated string, 0 if there is none
+    std::size_t
+    match(const char32_t *reading, bool end) const
+    {
+        std::size_t res = 0, count = 0;
+        for (auto state = start; *reading; ++reading)
+        {
+            if ((state = next[state * classes + class_of(*reading)]) == kDead)
+            {
+                return end ? 0 : res;
+            }
+            ++count;
+            if (accept[state])
+            {
+                res = count;
+            }
+        }
+        return res;
     }
-};
 
-class BracketNode : public Node
-{
-  private:
-    std::set<Scope> scopes;
+    std::size_t
+    memory_usage() const
+    {
+        return sizeof(*this) + next.capacity() * sizeof(next[0]) + accept.capacity()
+             + loops.capacity() * sizeof(SelfLoop) + tokens.capacity() * sizeof(tokens[0])
+             + masks.capacity() * sizeof(masks[0])
+             + bounds.capacity() * sizeof(bounds[0]);
+    }
 
-  public:
-    BracketNode(std::set<Scope> scopes) : scopes(scopes) {}
+    // longest non-empty accepted prefix of str from pos as (length, accepting state), length is 0 if there is none
+    std::pair<std::size_t, std::uint32_t>
+    longest(std::string_view str, std::size_t pos) const
+    {
+        auto first = reinterpret_cast<const unsigned char *>(str.data()) + pos;
+        auto last = reinterpret_cast<const unsigned char *>(str.data()) + str.size();
+        std::pair<std::size_t, std::uint32_t> res = { 0, kDead };
+        auto state = start;
+        walk(next.data(), first, last, state,
+            [&](const unsigned char *at, std::uint32_t in) { res = { at - first, in }; }, Unvisited());
+        return res;
+    }
 
-    virtual std::shared_ptr<NFAPair>
-    compile()
+    // continues a match of str which is in state at pos, res is the accepted length so far
+    std::size_t
+    resume(std::string_view str, std::size_t pos, std::uint32_t state, std::size_t res, bool end) const
     {
-        auto ptr = std::make_shared<NFAPair>();
+        return resume(next.data(), str, pos, state, res, end);
+    }
 
-        ptr->start->edge_type = NFAState::EdgeType::CCL;
-        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
-        ptr->start->next = ptr->end;
-        ptr->start->scopes.insert(scopes.begin(), scopes.end());
+    // the same with transitions instead of next, which may be a copy of it with narrower state numbers
+    template <typename StateId>
+    std::size_t
+    resume(const StateId *transitions, std::string_view str, std::size_t pos, std::uint32_t state, std::size_t res,
+           bool end) const
+    {
+        auto first = reinterpret_cast<const unsigned char *>(str.data());
+        walk(transitions, first + pos, first + str.size(), state,
+            [&](const unsigned char *at, std::uint32_t) { res = at - first; }, Unvisited());
+        return state == kDead && end ? std::string_view::npos : res;
+    }
 
-        return ptr;
+    // a match found by search, pos is npos if there is none
+    struct Found
+    {
+        std::size_t pos = std::string_view::npos;
+        std::size_t len = 0;
+        // the accepting state the match ends in
+        std::uint32_t state = kDead;
+        // for the result of search, past the last byte the search read, str.size() + 1 if it read up to the
+        // end of str, so the result only depends on str before it and on what spawn looked at
+        std::size_t reach = 0;
+
+        // leftmost first, then longest
+        bool
+        before(const Found &other) const
+        {
+            return pos < other.pos || (pos == other.pos && pos != std::string_view::npos && len > other.len);
+        }
+    };
+
+    // the leftmost non-empty match of str at or after from and the longest one there, as resume finds trying
+    // every start in turn with the same end. It does so while the walks stay short, but once they have read
+    // more than kWalkCredit bytes plus kWalkFactor per start it goes on in one pass over str: every start
+    // still in the race is a thread, and threads in the same state at the same byte go on alike, so only the
+    // earliest of them is kept and at most states() threads run at once. spawn(pos) gives the range [lo, hi]
+    // of the starts at or after pos worth trying, lo is npos if there are none; visits, if given, counts the
+    // bytes read in each state
+    template <typename Spawn>
+    Found
+    search(std::string_view str, std::size_t from, bool end, const Spawn &spawn,
+           std::vector<std::uint64_t> *visits = nullptr) const
+    {
+        if (visits)
+        {
+            return search_with(str, from, end, spawn,
+                [visits](std::uint32_t in, std::size_t bytes) { (*visits)[in] += bytes; });
+        }
+        return search_with(str, from, end, spawn, Unvisited());
     }
-};
 
-class Parse
-{
   private:
-    bool begin = false;
-    bool end   = false;
-    std::unordered_map<std::string, std::shared_ptr<Node>> ref_map;
-
-    char32_t
-    translate_escape_chr(const char32_t *&reading)
+    template <typename Spawn, typename Visit>
+    Found
+    search_with(std::string_view str, std::size_t from, bool end, const Spawn &spawn, const Visit &visit) const
     {
-        ++reading;
-        if (*reading)
+        struct Thread
         {
-            switch (*reading)
+            std::uint32_t state;
+            std::size_t start;
+            // the leftmost of the starts the thread stands for which was accepted so far
+            Found match;
+        };
+
+        auto first = reinterpret_cast<const unsigned char *>(str.data()), last = first + str.size();
+        auto npos = std::string_view::npos;
+        auto range = spawn(from);
+        auto pos = from;
+        char32_t chr;
+
+        // reading is past a character read, or where one could not be read: at a nul or a bad lead byte, a
+        // sequence cut off by the end, or the end itself
+        std::size_t reach = from;
+        auto note = [&](const unsigned char *reading, bool stuck)
+        {
+            auto size = stuck && reading != last ? std::max<std::size_t>(1, utf8_length(*reading)) : 0;
+            auto past = stuck && static_cast<std::size_t>(last - reading) <= size
+                ? str.size() + 1
+                : static_cast<std::size_t>(reading - first) + size;
+            reach = std::max(reach, past);
+        };
+        auto result = [&reach](Found found)
+        {
+            found.reach = reach;
+            return found;
+        };
+
+        for (auto credit = kWalkCredit; range.first != npos && range.first < str.size();)
+        {
+            pos = std::max(pos, range.first);
+
+            // most starts end at their first character
+            auto reading = first + pos;
+            if (read_utf8(reading, last, chr) && next[start * classes + class_of(chr)] == kDead)
             {
-            case '0':
-                return '\0';
-            case 'a':
-                return '\a';
-            case 'b':
-                return '\b';
-            case 't':
-                return '\t';
-            case 'n':
-                return '\n';
-            case 'v':
-                return '\v';
-            case 'f':
-                return '\f';
-            case 'r':
-                return '\r';
-            case 'e':
-                return '\e';
-            case 'c':
-                if (*(reading + 1) && (isalpha(*(reading + 1)) || (*(reading + 1) > 63 && *(reading + 1) < 94)))
-                {
-                    ++reading;
-                    return toupper(*reading) - 64;
-                }
-                else
+                visit(start, 1);
+                note(reading, false);
+                pos = reading - first;
+                if (pos > range.second)
                 {
-                    return 'c';
+                    range = spawn(pos);
                 }
-            default:
-                return *reading;
+                continue;
             }
-        }
-        else
-        {
-            return kChar32Max;
-        }
-    }
 
-    std::set<Scope>
-    translate_echr2scopes(char32_t &left, const char32_t *&reading, bool range)
-    {
-        auto res = translate_escape_chr(reading);
-        std::set<Scope> ret;
-        if (ECMAP.count(res))
-        {
-            ret = ECMAP[res];
-        }
-        else
-        {
-            left = res;
-        }
-        if (!range && ECMAP.count(res))
-        {
-            left = kChar32Max;
-        }
-        return ret;
-    }
+            Found match;
+            auto state = start;
+            auto stop = walk(next.data(), first + pos, last, state,
+                [&](const unsigned char *at, std::uint32_t in) { match = { pos, at - first - pos, in }; }, visit);
+            note(stop, state != kDead);
+            if (match.pos != npos && (state != kDead || !end))
+            {
+                return result(match);
+            }
 
-    std::shared_ptr<Node>
-    translate_echr2node(const char32_t *&reading)
-    {
-        std::shared_ptr<Node> node = nullptr;
-        char32_t left = kChar32Max;
-        auto res = translate_echr2scopes(left, reading, false);
-        if (left == kChar32Max)
-        {
-            node = std::make_shared<BracketNode>(res);
-        }
-        else
-        {
-            node = std::make_shared<LeafNode>(left);
+            auto read = static_cast<std::size_t>(stop - first) - pos;
+            auto after = pos + std::max<std::size_t>(1, utf8_length(str[pos]));
+            credit += kWalkFactor * (after - pos);
+            pos = after;
+            if (read > credit)
+            {
+                break;
+            }
+            credit -= read;
+            if (pos > range.second)
+            {
+                range = spawn(pos);
+            }
         }
-        return node;
-    }
 
-    std::shared_ptr<Node>
-    gen_bracket(const char32_t *&reading)
-    {
-        char32_t left = kChar32Max;
-        bool range = false, exclude = false;
-        std::set<Scope> scopes;
+        std::vector<Thread> threads, moved;
+        // moved[owner[state] - 1] is in state, only used once there are too many threads to look through
+        std::vector<std::uint32_t> owner;
+        Found best;
 
-        if (*reading == '^')
-        {
-            ++reading;
-            exclude = true;
-        }
-        if (*reading == ']')
+        for (;;)
         {
-            return std::make_shared<BracketNode>(scopes);
-        }
+            if (range.first != npos && pos > range.second)
+            {
+                range = spawn(pos);
+            }
 
-        while (*reading && *reading != ']')
-        {
-            if (*reading == '-')
+            // no thread runs, so skip the starts whose first character leads nowhere
+            while (threads.empty())
             {
-                if (!range && left != kChar32Max)
+                if (range.first == npos)
                 {
-                    range = true;
+                    return result(best);
+                }
+                pos = std::max(pos, range.first);
+                visit(start, 1);
+                auto reading = first + pos;
+                if (!read_utf8(reading, last, chr))
+                {
+                    note(reading, true);
+                    if (pos == str.size())
+                    {
+                        return result(best);
+                    }
+                    reading = first + pos + std::max<std::size_t>(1, utf8_length(str[pos]));
+                }
+                else
+                {
+                    note(reading, false);
+                    if (auto state = next[start * classes + class_of(chr)])
+                    {
+                        threads.push_back({ state, pos, accept[state] ? Found{ pos, reading - first - pos, state } : Found() });
+                    }
+                }
+                pos = reading - first;
+                if (pos > range.second)
+                {
+                    range = spawn(pos);
                 }
             }
-            else if (range)
+
+            // without end a match is final once found, so only the starts up to the leftmost one can still
+            // win, and the last of them can go on by itself, through the self loops too
+            if (!end)
             {
-                if (*reading == '\\')
+                auto leftmost = best.pos;
+                for (const auto &thread : threads)
                 {
-                    auto res = translate_echr2scopes(left, reading, true);
-                    scopes.insert(res.begin(), res.end());
+                    leftmost = std::min(leftmost, thread.match.pos);
                 }
-                else
+                if (leftmost != npos)
                 {
-                    scopes.insert({ left, *reading });
+                    range.first = npos;
+                    while (!threads.empty() && threads.back().start > leftmost)
+                    {
+                        threads.pop_back();
+                    }
                 }
-                left = kChar32Max;
-                range = false;
             }
-            else
+            if (threads.empty())
             {
-                if (left != kChar32Max)
+                continue;
+            }
+            if (threads.size() == 1 && range.first == npos)
+            {
+                auto &thread = threads[0];
+                auto state = thread.state;
+                auto stop = walk(next.data(), first + pos, last, state,
+                    [&](const unsigned char *at, std::uint32_t in) { thread.match = { thread.start, at - first - thread.start, in }; },
+                    visit);
+                note(stop, state != kDead);
+                return result((state != kDead || !end) && thread.match.before(best) ? thread.match : best);
+            }
+
+            if (range.first != npos && pos >= range.first)
+            {
+                threads.push_back({ start, pos, Found() });
+            }
+            auto reading = first + pos;
+            if (!read_utf8(reading, last, chr))
+            {
+                // every thread got to the end of its input, nul and bad bytes end it too
+                note(reading, true);
+                for (const auto &thread : threads)
                 {
-                    scopes.insert({ left, left });
+                    visit(thread.state, 1);
+                    best = thread.match.before(best) ? thread.match : best;
                 }
-                if (*reading == '\\')
+                threads.clear();
+                if (best.pos != npos || pos == str.size())
                 {
-                    auto res = translate_echr2scopes(left, reading, false);
-                    scopes.insert(res.begin(), res.end());
+                    return result(best);
+                }
+                pos += std::max<std::size_t>(1, utf8_length(str[pos]));
+                continue;
+            }
+
+            note(reading, false);
+            auto k = class_of(chr);
+            auto indexed = threads.size() > kLinearThreads;
+            if (indexed && owner.empty())
+            {
+                owner.assign(states(), 0);
+            }
+            moved.clear();
+            for (auto &thread : threads)
+            {
+                visit(thread.state, 1);
+                auto state = next[thread.state * classes + k];
+                if (state == kDead)
+                {
+                    // with end a match stuck before the end of the input is none
+                    best = !end && thread.match.before(best) ? thread.match : best;
+                    continue;
+                }
+                if (accept[state])
+                {
+                    thread.match = { thread.start, reading - first - thread.start, state };
+                }
+
+                // an earlier thread in the same state also stands for this one from now on
+                std::size_t j = 0;
+                if (indexed)
+                {
+                    j = owner[state] ? owner[state] - 1 : moved.size();
                 }
                 else
                 {
-                    left = *reading;
+                    while (j < moved.size() && moved[j].state != state)
+                    {
+                        ++j;
+                    }
+                }
+                if (j < moved.size())
+                {
+                    moved[j].match = thread.match.before(moved[j].match) ? thread.match : moved[j].match;
+                    continue;
+                }
+                moved.push_back({ state, thread.start, thread.match });
+                if (indexed)
+                {
+                    owner[state] = moved.size();
                 }
             }
-            ++reading;
+            for (std::size_t j = 0; indexed && j < moved.size(); ++j)
+            {
+                owner[moved[j].state] = 0;
+            }
+            threads.swap(moved);
+            pos = reading - first;
         }
+    }
 
-        if (left != kChar32Max)
+  public:
+    // gives the state numbered order[k] the number k, order[0] is the dead state
+    void
+    renumber(const std::vector<std::uint32_t> &order)
+    {
+        std::vector<std::uint32_t> number(order.size());
+        for (std::uint32_t k = 0; k < order.size(); ++k)
         {
-            scopes.insert({ left, left });
+            number[order[k]] = k;
         }
 
-        if (exclude)
+        auto permute = [&order](auto &items)
         {
-            std::vector<Scope> sorted_scopes(scopes.begin(), scopes.end());
-            std::sort(sorted_scopes.begin(), sorted_scopes.end(), [](Scope a, Scope b)
-            {
-                return a.first < b.first;
-            });
-
-            decltype(scopes) temp;
-            char32_t start = kChar32Min;
-            for (auto scope : sorted_scopes)
+            if (!items.empty())
             {
-                if (start < scope.first)
-                {
-                    temp.insert({ start, scope.first - 1 });
-                    start = scope.second + 1;
-                }
-                else if (scope.second >= start)
+                auto old = items;
+                for (std::size_t k = 0; k < order.size(); ++k)
                 {
-                    start = scope.second + 1;
+                    items[k] = old[order[k]];
                 }
             }
-            temp.insert({ start, kChar32Max });
+        };
+        permute(accept);
+        permute(loops);
+        permute(tokens);
+        permute(masks);
 
-            scopes = temp;
+        auto old = next;
+        for (std::size_t k = 0; k < order.size(); ++k)
+        {
+            for (std::size_t c = 0; c < classes; ++c)
+            {
+                next[k * classes + c] = number[old[order[k] * classes + c]];
+            }
         }
-
-        return std::make_shared<BracketNode>(scopes);
+        start = number[start];
     }
 
-    std::shared_ptr<Node>
-    gen_subexpr(const char32_t *&reading)
+    // same as match over every input, but advances Lanes inputs in lockstep so their loads overlap,
+    // a lane is refilled with the next input as soon as its own input is done
+    template <std::size_t Lanes>
+    void
+    match_lanes(const std::string_view *strs, std::size_t count, bool end, std::size_t *lengths) const
     {
-        std::shared_ptr<Node> node = nullptr;
-        if (*reading == '?')
+        LaneSet<Lanes> lanes;
+        std::size_t active = 0, fed = 0;
+
+        auto feed = [&](std::size_t k)
         {
-            ++reading;
-            if (*reading == ':')
-            {
-                ++reading;
-            }
-            if (*reading == '<')
+            if (fed == count)
             {
-                ++reading;
+                return false;
             }
-            std::string name;
-            while (isalnum(*reading) || *reading == '_')
+            if (fed + Lanes < count)
             {
-                name += *reading++;
+                prefetch(strs[fed + Lanes].data());
             }
-            if (*reading == '>')
+            lanes.first[k] = lanes.reading[k] = reinterpret_cast<const unsigned char *>(strs[fed].data());
+            lanes.last[k] = lanes.first[k] + strs[fed].size();
+            lanes.state[k] = start;
+            lanes.res[k] = accept[start] ? 0 : std::string_view::npos;
+            lanes.index[k] = fed++;
+            return true;
+        };
+
+        auto retire = [&](std::size_t k, std::size_t res)
+        {
+            lengths[lanes.index[k]] = res;
+            if (feed(k))
             {
-                ++reading;
+                return;
             }
-            if (*reading == ')')
+            --active;
+            lanes.first[k] = lanes.first[active];
+            lanes.reading[k] = lanes.reading[active];
+            lanes.last[k] = lanes.last[active];
+            lanes.state[k] = lanes.state[active];
+            lanes.res[k] = lanes.res[active];
+            lanes.index[k] = lanes.index[active];
+        };
+
+        while (active < Lanes && feed(active))
+        {
+            ++active;
+        }
+
+        while (active)
+        {
+            for (std::size_t k = 0; k < active; ++k)
             {
-                if (ref_map.count(name))
+                char32_t chr;
+                if (!read_utf8(lanes.reading[k], lanes.last[k], chr))
                 {
-                    return ref_map[name];
+                    retire(k, lanes.res[k]);
+                }
+                else if ((lanes.state[k] = next[lanes.state[k] * classes + class_of(chr)]) == kDead)
+                {
+                    retire(k, end ? std::string_view::npos : lanes.res[k]);
+                }
+                else if (accept[lanes.state[k]])
+                {
+                    lanes.res[k] = lanes.reading[k] - lanes.first[k];
                 }
-            }
-            else
-            {
-                node = gen_node(reading);
-                ref_map[name] = node;
             }
         }
-        else
+    }
+};
+
+// state of a backtracking walk over the syntax tree, only used to locate groups inside a span the DFA matched
+struct Submatch
+{
+    using Next = std::function<bool(std::size_t)>;
+
+    std::string_view str;
+    // (position, length) of every group, position is npos if the group did not take part
+    std::vector<std::pair<std::size_t, std::size_t>> groups;
+
+    bool
+    read(std::size_t &pos, char32_t &chr) const
+    {
+        auto first = reinterpret_cast<const unsigned char *>(str.data());
+        auto reading = first + pos;
+        if (!read_utf8(reading, first + str.size(), chr))
         {
-            node = gen_node(reading);
+            return false;
         }
-        return node;
+        pos = reading - first;
+        return true;
     }
+};
 
-    std::shared_ptr<Node>
-    gen_node(const char32_t *&reading)
+// the transitions of a DFATable with StateId wide state numbers, a quarter or half the bytes of the table's
+// own, so that the rows of a small DFA stay in L1; everything but next is read from the table
+template <typename StateId>
+class NarrowTable
+{
+  private:
+    std::shared_ptr<const DFATable> table;
+    std::vector<StateId> next;
+
+  public:
+    // whether the states of table can be numbered with StateId
+    static bool
+    fits(const DFATable &table)
     {
-        std::shared_ptr<Node> node = nullptr, right = nullptr;
+        return table.states() - 1 <= std::numeric_limits<StateId>::max();
+    }
 
-        if (*reading == '^')
-        {
-            ++reading;
-            begin = true;
-        }
+    NarrowTable(std::shared_ptr<const DFATable> table)
+      : table(table), next(table->next.begin(), table->next.end()) {}
 
-        if (*reading == '(')
-        {
-            ++reading;
-            node = gen_subexpr(reading);
-        }
-        else if (*reading == '[')
-        {
-            ++reading;
-            node = gen_bracket(reading);
+    std::size_t
+    memory_usage() const
+    {
+        return sizeof(*this) + next.capacity() * sizeof(StateId);
+    }
+
+    // same as DFATable::match, with the table's own walk over the narrow rows
+    std::size_t
+    match(std::string_view str, bool end) const
+    {
+        return table->resume(next.data(), str, 0, table->start,
+            table->accept[table->start] ? 0 : std::string_view::npos, end);
+    }
+};
+
+// native x86-64 code for the ascii transitions of a DFATable, every other byte is handed back to the table
+class DFAJit
+{
+  private:
+    // written by the generated code, the layout is part of it
+    struct Exit
+    {
+        const unsigned char *reading;
+        const unsigned char *accepted;
+        std::uint32_t state;
+    };
+    using Function = void (*)(const unsigned char *reading, const unsigned char *last, Exit *exit);
+
+    std::shared_ptr<const DFATable> table;
+    void *code = nullptr;
+    std::size_t size = 0;
+    Function function = nullptr;
+
+    class Assembler
+    {
+      public:
+        std::vector<unsigned char> bytes;
+        std::vector<std::size_t> labels;
+        // (position of a rel32, label it refers to)
+        std::vector<std::pair<std::size_t, std::size_t>> fixups;
+
+        Assembler(std::size_t labels) : labels(labels) {}
+
+        void
+        emit(std::initializer_list<unsigned char> code)
+        {
+            bytes.insert(bytes.end(), code);
         }
-        else if (*reading == '.')
+
+        void
+        emit32(std::uint32_t value)
         {
-            node = std::make_shared<DotNode>();
+            for (int i = 0; i < 4; ++i)
+            {
+                bytes.push_back(value >> i * 8 & 0xFF);
+            }
         }
-        else if (*reading && *reading != '|' && *reading != ')')
+
+        void
+        bind(std::size_t label)
         {
-            node = *reading == '\\'
-                ? translate_echr2node(reading)
-                : std::make_shared<LeafNode>(*reading);
+            labels[label] = bytes.size();
         }
 
-        if (!node)
+        // jmp, or a jcc given its second opcode byte
+        void
+        jump(std::size_t label, unsigned char cc = 0)
         {
-            return node;
+            if (cc)
+            {
+                emit({ 0x0F, cc });
+            }
+            else
+            {
+                emit({ 0xE9 });
+            }
+            fixups.push_back({ bytes.size(), label });
+            emit32(0);
         }
-        ++reading;
 
-        while (*reading && *reading != '|' && *reading != ')' && *reading != '$')
+        void
+        link()
         {
-            switch (*reading)
+            for (auto fixup : fixups)
             {
-            case '(':
-                ++reading;
-                if (right)
-                {
-                    node = std::make_shared<CatNode>(node, right);
-                }
-                right = gen_subexpr(reading);
-                break;
-            case '[':
-                ++reading;
-                if (right)
+                auto rel = static_cast<std::uint32_t>(labels[fixup.second] - (fixup.first + 4));
+                for (int i = 0; i < 4; ++i)
                 {
-                    node = std::make_shared<CatNode>(node, right);
+                    bytes[fixup.first + i] = rel >> i * 8 & 0xFF;
                 }
-                right = gen_bracket(reading);
-                break;
-            case '{':
-                ++reading;
-                if (isdigit(*reading))
-                {
-                    int n = *reading - '0', m = -2;
-                    ++reading;
-                    if (*reading == ',')
-                    {
-                        ++reading;
-                        m = isdigit(*reading)
-                            ? *reading++ - '0'
-                            : -1;
-                    }
+            }
+        }
+    };
 
-                    if (right)
-                    {
-                        right = std::make_shared<QualifierNode>(right, n, m);
-                    }
-                    else
-                    {
-                        node = std::make_shared<QualifierNode>(node, n, m);
-                    }
-                }
-                break;
-            case '*':
-                if (right)
-                {
-                    right = std::make_shared<ClosureNode>(right);
-                }
-                else
-                {
-                    node = std::make_shared<ClosureNode>(node);
-                }
-                break;
-            case '+':
-                if (right)
-                {
-                    right = std::make_shared<QualifierNode>(right, 1, -1);
-                }
-                else
+  public:
+    static constexpr unsigned char kJe = 0x84, kJa = 0x87, kJbe = 0x86;
+
+    DFAJit(std::shared_ptr<const DFATable> table) : table(table)
+    {
+#ifdef YARE_JIT
+        // labels: states 0 ... n - 1, their exits n ... 2n - 1, then the shared epilogue
+        auto n = table->states();
+        auto exit_of = [&](std::size_t state) { return n + state; };
+        auto epilogue = 2 * n;
+        Assembler as(2 * n + 1);
+
+        // rdi = reading, rsi = last, rdx = exit, r8 = accepted
+        as.emit({ 0x4C, 0x8B, 0x42, 0x08 });                // mov r8, [rdx + 8]
+        as.jump(table->start);
+
+        for (std::size_t state = 1; state < n; ++state)
+        {
+            as.bind(state);
+            if (table->accept[state])
+            {
+                as.emit({ 0x49, 0x89, 0xF8 });              // mov r8, rdi
+            }
+            as.emit({ 0x48, 0x39, 0xF7 });                  // cmp rdi, rsi
+            as.jump(exit_of(state), kJe);
+            as.emit({ 0x0F, 0xB6, 0x07 });                  // movzx eax, byte [rdi]
+            as.emit({ 0x8D, 0x48, 0xFF });                  // lea ecx, [rax - 1]
+            as.emit({ 0x83, 0xF9, 0x7E });                  // cmp ecx, 126
+            as.jump(exit_of(state), kJa);                   // nul or not ascii
+            as.emit({ 0x48, 0xFF, 0xC7 });                  // inc rdi
+
+            // one compare per run of ascii characters sharing a target, so self loops stay tight
+            for (char32_t chr = 1; chr < 128;)
+            {
+                auto target = table->next[state * table->classes + table->class_of(chr)];
+                auto last = chr;
+                while (last + 1 < 128 && table->next[state * table->classes + table->class_of(last + 1)] == target)
                 {
-                    node = std::make_shared<QualifierNode>(node, 1, -1);
+                    ++last;
                 }
-                break;
-            case '?':
-                if (right)
+                auto label = target == DFATable::kDead ? exit_of(DFATable::kDead) : target;
+                if (last + 1 < 128)
                 {
-                    right = std::make_shared<QualifierNode>(right, 0, 1);
+                    as.emit({ 0x83, 0xF8, static_cast<unsigned char>(last) }); // cmp eax, last
+                    as.jump(label, kJbe);
                 }
                 else
                 {
-                    node = std::make_shared<QualifierNode>(node, 0, 1);
-                }
-                break;
-            case '.':
-                if (right)
-                {
-                    node = std::make_shared<CatNode>(node, right);
+                    as.jump(label);
                 }
-                right = std::make_shared<DotNode>();
-                break;
-            default:
-                if (right)
+                chr = last + 1;
+            }
+        }
+
+        for (std::size_t state = 0; state < n; ++state)
+        {
+            as.bind(exit_of(state));
+            as.emit({ 0xC7, 0x42, 0x10 });                  // mov dword [rdx + 16], state
+            as.emit32(state);
+            as.jump(epilogue);
+        }
+
+        as.bind(epilogue);
+        as.emit({ 0x48, 0x89, 0x3A });                      // mov [rdx], rdi
+        as.emit({ 0x4C, 0x89, 0x42, 0x08 });                // mov [rdx + 8], r8
+        as.emit({ 0xC3 });                                  // ret
+        as.link();
+
+        size = as.bytes.size();
+        code = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code == MAP_FAILED)
+        {
+            code = nullptr;
+            return;
+        }
+        std::copy(as.bytes.begin(), as.bytes.end(), static_cast<unsigned char *>(code));
+        if (mprotect(code, size, PROT_READ | PROT_EXEC) == 0)
+        {
+            function = reinterpret_cast<Function>(code);
+        }
+#endif
+    }
+
+    ~DFAJit()
+    {
+#ifdef YARE_JIT
+        if (code)
+        {
+            munmap(code, size);
+        }
+#endif
+    }
+
+    DFAJit(const DFAJit &) = delete;
+    DFAJit &operator=(const DFAJit &) = delete;
+
+    // the mapped code, the table is accounted for by its owner
+    std::size_t
+    memory_usage() const
+    {
+        return sizeof(*this) + size;
+    }
+
+    // false if there is no jit for this platform, or the code could not be mapped
+    bool
+    ready() const
+    {
+        return function != nullptr;
+    }
+
+    // same as DFATable::match
+    std::size_t
+    match(std::string_view str, bool end) const
+    {
+        if (str.empty())
+        {
+            return table->match(str, end);
+        }
+
+        auto first = reinterpret_cast<const unsigned char *>(str.data());
+        auto last = first + str.size();
+        Exit exit{ first, table->accept[table->start] ? first : nullptr, 0 };
+        function(first, last, &exit);
+
+        auto res = exit.accepted ? exit.accepted - first : std::string_view::npos;
+        if (exit.state == DFATable::kDead)
+        {
+            return end ? std::string_view::npos : res;
+        }
+        if (exit.reading == last)
+        {
+            return res;
+        }
+        return table->resume(str, exit.reading - first, exit.state, res, end);
+    }
+};
+
+// literals every match of a node has to contain, an empty string means there is none
+struct Literals
+{
+    // whether the node matches exactly one string, which is then the prefix
+    bool exact = false;
+    std::u32string prefix;
+    std::u32string suffix;
+    std::u32string inner;
+
+    static Literals
+    of(const std::u32string &str)
+    {
+        return { true, str, str, str };
+    }
+
+    static const std::u32string &
+    longer(const std::u32string &a, const std::u32string &b)
+    {
+        return a.size() >= b.size() ? a : b;
+    }
+};
+
+// bounds of the byte length of every match of a node
+struct Lengths
+{
+    static constexpr std::size_t kUnbounded = std::numeric_limits<std::size_t>::max();
+
+    std::size_t min = 0;
+    std::size_t max = 0;
+
+    static std::size_t
+    add(std::size_t a, std::size_t b)
+    {
+        return a == kUnbounded || b == kUnbounded ? kUnbounded : a + b;
+    }
+
+    static std::size_t
+    mul(std::size_t a, std::size_t count)
+    {
+        return !a || !count ? 0 : a == kUnbounded || count == kUnbounded ? kUnbounded : a * count;
+    }
+};
+
+class Node : public std::enable_shared_from_this<Node>
+{
+  public:
+    virtual ~Node() {}
+
+    // an equivalent node for compile() with fewer NFA states, groups are dropped since compile() ignores them
+    virtual std::shared_ptr<Node>
+    simplify()
+    {
+        return shared_from_this();
+    }
+
+    // the characters of the node if it always matches exactly one character
+    virtual bool
+    single(std::set<Scope> &)
+    {
+        return false;
+    }
+
+    // appends the characters of the node if it matches exactly one run of literal characters
+    virtual bool
+    literal(std::u32string &)
+    {
+        return false;
+    }
+
+    // splits off the literal character every match starts with, rest is nullptr if nothing follows it
+    virtual bool
+    head(char32_t &, std::shared_ptr<Node> &)
+    {
+        return false;
+    }
+
+    // the repeated node if this node is x*, x+ or x?, which all repeat to x* inside a closure
+    virtual std::shared_ptr<Node>
+    loop_body()
+    {
+        return nullptr;
+    }
+
+    virtual Lengths
+    lengths() = 0;
+
+    // bytes of the subtree, subexpressions referenced more than once count every time
+    virtual std::size_t
+    memory_usage() = 0;
+
+    virtual Literals
+    literals() = 0;
+
+    virtual std::shared_ptr<NFAPair>
+    compile() = 0;
+
+    // calls next with every position the node can end at when started at pos, preferred ones first,
+    // until next returns true
+    virtual bool
+    walk(Submatch &sub, std::size_t pos, const Submatch::Next &next) = 0;
+};
+
+class LeafNode : public Node
+{
+  private:
+    char32_t leaf;
+
+  public:
+    LeafNode(char32_t c) : leaf(c) {}
+
+    virtual std::shared_ptr<NFAPair>
+    compile()
+    {
+        auto ptr = std::make_shared<NFAPair>();
+
+        ptr->start->edge_type = NFAState::EdgeType::CCL;
+        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
+        ptr->start->next = ptr->end;
+        ptr->start->scopes.insert({ leaf, leaf });
+
+        return ptr;
+    }
+
+    virtual Literals
+    literals()
+    {
+        return Literals::of(std::u32string(1, leaf));
+    }
+
+    virtual Lengths
+    lengths()
+    {
+        return { utf8_bytes(leaf), utf8_bytes(leaf) };
+    }
+
+    virtual bool
+    single(std::set<Scope> &scopes)
+    {
+        scopes.insert({ leaf, leaf });
+        return true;
+    }
+
+    virtual bool
+    literal(std::u32string &str)
+    {
+        str += leaf;
+        return true;
+    }
+
+    virtual bool
+    head(char32_t &chr, std::shared_ptr<Node> &rest)
+    {
+        chr = leaf;
+        rest = nullptr;
+        return true;
+    }
+
+    virtual std::size_t
+    memory_usage()
+    {
+        return sizeof(*this);
+    }
+
+    virtual bool
+    walk(Submatch &sub, std::size_t pos, const Submatch::Next &next)
+    {
+        char32_t chr;
+        return sub.read(pos, chr) && chr == leaf && next(pos);
+    }
+};
+
+// a run of literal characters, only made by simplify(), it compiles to a chain without epsilon edges
+class StringNode : public Node
+{
+  private:
+    std::u32string str;
+
+  public:
+    StringNode(std::u32string str) : str(str) {}
+
+    virtual std::shared_ptr<NFAPair>
+    compile()
+    {
+        auto ptr = std::make_shared<NFAPair>();
+        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
+
+        auto state = ptr->start;
+        for (std::size_t i = 0; i < str.size(); ++i)
+        {
+            state->edge_type = NFAState::EdgeType::CCL;
+            state->scopes.insert({ str[i], str[i] });
+            state->next = i + 1 == str.size() ? ptr->end : std::make_shared<NFAState>();
+            state = state->next;
+        }
+
+        return ptr;
+    }
+
+    virtual Literals
+    literals()
+    {
+        return Literals::of(str);
+    }
+
+    virtual Lengths
+    lengths()
+    {
+        std::size_t bytes = 0;
+        for (auto chr : str)
+        {
+            bytes += utf8_bytes(chr);
+        }
+        return { bytes, bytes };
+    }
+
+    virtual bool
+    literal(std::u32string &str)
+    {
+        str += this->str;
+        return true;
+    }
+
+    virtual bool
+    head(char32_t &chr, std::shared_ptr<Node> &rest)
+    {
+        chr = str[0];
+        rest = str.size() == 2
+            ? std::static_pointer_cast<Node>(std::make_shared<LeafNode>(str[1]))
+            : std::make_shared<StringNode>(str.substr(1));
+        return true;
+    }
+
+    virtual std::size_t
+    memory_usage()
+    {
+        return sizeof(*this) + str.capacity() * sizeof(char32_t);
+    }
+
+    virtual bool
+    walk(Submatch &sub, std::size_t pos, const Submatch::Next &next)
+    {
+        char32_t chr;
+        for (auto expected : str)
+        {
+            if (!sub.read(pos, chr) || chr != expected)
+            {
+                return false;
+            }
+        }
+        return next(pos);
+    }
+};
+
+class CatNode : public Node
+{
+  private:
+    std::shared_ptr<Node> left;
+    std::shared_ptr<Node> right;
+
+  public:
+    CatNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right) : left(left), right(right) {}
+
+    // appends the operands of a chain of concatenations in order
+    static void
+    sequence(const std::shared_ptr<Node> &node, std::vector<std::shared_ptr<Node>> &nodes)
+    {
+        if (auto cat = std::dynamic_pointer_cast<CatNode>(node))
+        {
+            sequence(cat->left, nodes);
+            sequence(cat->right, nodes);
+        }
+        else
+        {
+            nodes.push_back(node);
+        }
+    }
+
+    // concatenates nodes, every run of literals becomes one node
+    static std::shared_ptr<Node>
+    concat(const std::vector<std::shared_ptr<Node>> &nodes)
+    {
+        std::vector<std::shared_ptr<Node>> merged;
+        std::u32string run;
+        auto flush = [&]()
+        {
+            if (run.size() == 1)
+            {
+                merged.push_back(std::make_shared<LeafNode>(run[0]));
+            }
+            else if (run.size() > 1)
+            {
+                merged.push_back(std::make_shared<StringNode>(run));
+            }
+            run.clear();
+        };
+
+        for (const auto &node : nodes)
+        {
+            if (!node->literal(run))
+            {
+                flush();
+                merged.push_back(node);
+            }
+        }
+        flush();
+
+        auto res = merged.back();
+        for (auto it = merged.rbegin() + 1; it != merged.rend(); ++it)
+        {
+            res = std::make_shared<CatNode>(*it, res);
+        }
+        return res;
+    }
+
+    virtual std::shared_ptr<NFAPair>
+    compile()
+    {
+        auto left = this->left->compile();
+        auto right = this->right->compile();
+        auto ptr = std::make_shared<NFAPair>(left->start, right->end);
+
+        left->end->edge_type = NFAState::EdgeType::EPSILON;
+        left->end->next = right->start;
+
+        return ptr;
+    }
+
+    virtual Literals
+    literals()
+    {
+        auto left = this->left->literals();
+        auto right = this->right->literals();
+        if (left.exact && right.exact)
+        {
+            return Literals::of(left.prefix + right.prefix);
+        }
+
+        Literals res;
+        res.prefix = left.exact ? left.prefix + right.prefix : left.prefix;
+        res.suffix = right.exact ? left.suffix + right.suffix : right.suffix;
+        res.inner = Literals::longer(Literals::longer(left.inner, right.inner), left.suffix + right.prefix);
+        res.inner = Literals::longer(res.inner, Literals::longer(res.prefix, res.suffix));
+        return res;
+    }
+
+    virtual Lengths
+    lengths()
+    {
+        auto left = this->left->lengths();
+        auto right = this->right->lengths();
+        return { left.min + right.min, Lengths::add(left.max, right.max) };
+    }
+
+    virtual std::shared_ptr<Node>
+    simplify()
+    {
+        std::vector<std::shared_ptr<Node>> nodes, simplified;
+        sequence(left, nodes);
+        sequence(right, nodes);
+        for (const auto &node : nodes)
+        {
+            sequence(node->simplify(), simplified);
+        }
+        return concat(simplified);
+    }
+
+    virtual bool
+    head(char32_t &chr, std::shared_ptr<Node> &rest)
+    {
+        if (!left->head(chr, rest))
+        {
+            return false;
+        }
+        rest = rest ? std::make_shared<CatNode>(rest, right) : right;
+        return true;
+    }
+
+    virtual std::size_t
+    memory_usage()
+    {
+        return sizeof(*this) + left->memory_usage() + right->memory_usage();
+    }
+
+    virtual bool
+    walk(Submatch &sub, std::size_t pos, const Submatch::Next &next)
+    {
+        return left->walk(sub, pos, [&](std::size_t mid)
+        {
+            return right->walk(sub, mid, next);
+        });
+    }
+};
+
+class ClosureNode : public Node
+{
+  private:
+    std::shared_ptr<Node> content;
+
+  public:
+    ClosureNode(std::shared_ptr<Node> content) : content(content) {}
+
+    // closure of content, with nested repeats like (x*)* and (x+)* collapsed
+    static std::shared_ptr<Node>
+    star(std::shared_ptr<Node> content)
+    {
+        while (auto body = content->loop_body())
+        {
+            content = body;
+        }
+        return std::make_shared<ClosureNode>(content);
+    }
+
+    virtual std::shared_ptr<NFAPair>
+    compile()
+    {
+        auto content = this->content->compile();
+        auto ptr = std::make_shared<NFAPair>();
+
+        ptr->start->edge_type = NFAState::EdgeType::EPSILON;
+        ptr->start->next = content->start;
+        ptr->start->next2 = ptr->end;
+        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
+
+        content->end->edge_type = NFAState::EdgeType::EPSILON;
+        content->end->next = content->start;
+        content->end->next2 = ptr->end;
+
+        return ptr;
+    }
+
+    virtual Literals
+    literals()
+    {
+        return Literals();
+    }
+
+    virtual Lengths
+    lengths()
+    {
+        return { 0, content->lengths().max ? Lengths::kUnbounded : 0 };
+    }
+
+    virtual std::shared_ptr<Node>
+    simplify()
+    {
+        return star(content->simplify());
+    }
+
+    virtual std::shared_ptr<Node>
+    loop_body()
+    {
+        return content;
+    }
+
+    virtual std::size_t
+    memory_usage()
+    {
+        return sizeof(*this) + content->memory_usage();
+    }
+
+    virtual bool
+    walk(Submatch &sub, std::size_t pos, const Submatch::Next &next)
+    {
+        // an iteration has to consume something, otherwise the walk would never end
+        Submatch::Next loop = [&](std::size_t from)
+        {
+            return content->walk(sub, from, [&](std::size_t to)
+            {
+                return to != from && loop(to);
+            }) || next(from);
+        };
+        return loop(pos);
+    }
+};
+
+class QualifierNode : public Node
+{
+  private:
+    std::shared_ptr<Node> content;
+    int n;
+    int m;
+
+    // the repeat counts accepted by the NFA which compile() builds
+    bool
+    more(int count) const
+    {
+        return m == -2 ? count < n
+             : m == -1 ? true
+             : n < m && n >= 0 ? count < m
+             : false;
+    }
+
+    bool
+    stop(int count) const
+    {
+        return m == -2 ? count == n
+             : m == -1 ? count >= n
+             : n < m && n >= 0 ? count == m || (count ? count >= n - 1 : n == 0)
+             : true;
+    }
+
+    int
+    min_count() const
+    {
+        int count = 0;
+        while (!stop(count))
+        {
+            ++count;
+        }
+        return count;
+    }
+
+  public:
+    QualifierNode(std::shared_ptr<Node> content, int n, int m) : content(content), n(n), m(m) {}
+
+    virtual std::shared_ptr<NFAPair>
+    compile()
+    {
+        auto ptr = std::make_shared<NFAPair>();
+        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
+
+        // -2 means '{n}', -1 means '{n,}', >=0 means '{n,m}'
+        if (m == -2) // for '{n}'
+        {
+            std::shared_ptr<Node> temp = (n > 0) ? content : nullptr;
+            for (int i = 1; i < n; ++i)
+            {
+                temp = std::make_shared<CatNode>(temp, content);
+            }
+            if (temp)
+            {
+                return temp->compile();
+            }
+            else
+            {
+                ptr->start->edge_type = NFAState::EdgeType::EPSILON;
+                ptr->start->next = ptr->end;
+            }
+        }
+        else if (m == -1) // for '{n,}'
+        {
+            std::shared_ptr<Node> temp = (n > 0) ? content : nullptr;
+            for (int i = 1; i < n; ++i)
+            {
+                temp = std::make_shared<CatNode>(temp, content);
+            }
+            return temp
+                   ? std::make_shared<CatNode>(temp, std::make_shared<ClosureNode>(content))->compile()
+                   : std::make_shared<ClosureNode>(content)->compile();
+        }
+        else if (n < m && n >= 0) // for '{n,m}'
+        {
+            auto first = content->compile();
+            auto pre = first;
+            ptr->start->edge_type = NFAState::EdgeType::EPSILON;
+            ptr->start->next = first->start;
+            if (n == 0)
+            {
+                ptr->start->next2 = ptr->end;
+            }
+
+            for (int i = 1; i < m; ++i)
+            {
+                auto now = content->compile();
+                pre->end->edge_type = NFAState::EdgeType::EPSILON;
+                pre->end->next = now->start;
+                if (i > n - 2)
+                {
+                    pre->end->next2 = ptr->end;
+                }
+                pre = now;
+            }
+
+            pre->end->edge_type = NFAState::EdgeType::EPSILON;
+            pre->end->next = ptr->end;
+        }
+        else
+        {
+            ptr->start->edge_type = NFAState::EdgeType::EPSILON;
+            ptr->start->next = ptr->end;
+        }
+
+        return ptr;
+    }
+
+    virtual Literals
+    literals()
+    {
+        if (m == -2)
+        {
+            auto content = this->content->literals();
+            if (content.exact)
+            {
+                std::u32string str;
+                for (int i = 0; i < n; ++i)
+                {
+                    str += content.prefix;
+                }
+                return Literals::of(str);
+            }
+        }
+        if (!min_count())
+        {
+            return Literals();
+        }
+        // at least one repeat keeps everything which is required of the content
+        auto res = content->literals();
+        res.exact = false;
+        return res;
+    }
+
+    virtual Lengths
+    lengths()
+    {
+        auto content = this->content->lengths();
+        auto most = m == -2 ? n
+                  : m == -1 ? -1
+                  : n < m && n >= 0 ? m
+                  : 0;
+        return {
+            content.min * min_count(),
+            most < 0 ? Lengths::mul(content.max, Lengths::kUnbounded) : Lengths::mul(content.max, most)
+        };
+    }
+
+    virtual std::shared_ptr<Node>
+    simplify()
+    {
+        auto content = this->content->simplify();
+        if (m == -2 && n == 1)
+        {
+            return content;
+        }
+        if (loop_body())
+        {
+            // (x*)+ and (x*)? are x*, and x{0,} is x*
+            if (std::dynamic_pointer_cast<ClosureNode>(content))
+            {
+                return content;
+            }
+            if (n == 0 && m == -1)
+            {
+                return ClosureNode::star(content);
+            }
+        }
+        return std::make_shared<QualifierNode>(content, n, m);
+    }
+
+    virtual std::shared_ptr<Node>
+    loop_body()
+    {
+        return (m == -1 && n <= 1) || (m == 1 && n == 0) ? content : nullptr;
+    }
+
+    virtual std::size_t
+    memory_usage()
+    {
+        return sizeof(*this) + content->memory_usage();
+    }
+
+    virtual bool
+    walk(Submatch &sub, std::size_t pos, const Submatch::Next &next)
+    {
+        std::function<bool(int, std::size_t)> repeat = [&](int count, std::size_t from)
+        {
+            if (more(count) && content->walk(sub, from, [&](std::size_t to)
+                {
+                    return (to != from || !stop(count)) && repeat(count + 1, to);
+                }))
+            {
+                return true;
+            }
+            return stop(count) && next(from);
+        };
+        return repeat(0, pos);
+    }
+};
+
+class DotNode : public Node
+{
+  public:
+    virtual std::shared_ptr<NFAPair>
+    compile()
+    {
+        auto ptr = std::make_shared<NFAPair>();
+
+        ptr->start->edge_type = NFAState::EdgeType::CCL;
+        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
+        ptr->start->next = ptr->end;
+        ptr->start->scopes.insert({ kChar32Min, 31ULL });
+        ptr->start->scopes.insert({ 33ULL, kChar32Max });
+
+        return ptr;
+    }
+
+    virtual Literals
+    literals()
+    {
+        return Literals();
+    }
+
+    virtual Lengths
+    lengths()
+    {
+        return { 1, 4 };
+    }
+
+    virtual bool
+    single(std::set<Scope> &scopes)
+    {
+        scopes.insert({ kChar32Min, 31ULL });
+        scopes.insert({ 33ULL, kChar32Max });
+        return true;
+    }
+
+    virtual std::size_t
+    memory_usage()
+    {
+        return sizeof(*this);
+    }
+
+    virtual bool
+    walk(Submatch &sub, std::size_t pos, const Submatch::Next &next)
+    {
+        char32_t chr;
+        return sub.read(pos, chr) && chr != 32 && next(pos);
+    }
+};
+
+class BracketNode : public Node
+{
+  private:
+    std::set<Scope> scopes;
+
+  public:
+    BracketNode(std::set<Scope> scopes) : scopes(scopes) {}
+
+    virtual std::shared_ptr<NFAPair>
+    compile()
+    {
+        auto ptr = std::make_shared<NFAPair>();
+
+        ptr->start->edge_type = NFAState::EdgeType::CCL;
+        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
+        ptr->start->next = ptr->end;
+        ptr->start->scopes.insert(scopes.begin(), scopes.end());
+
+        return ptr;
+    }
+
+    virtual Literals
+    literals()
+    {
+        if (scopes.size() == 1 && scopes.begin()->first == scopes.begin()->second)
+        {
+            return Literals::of(std::u32string(1, scopes.begin()->first));
+        }
+        return Literals();
+    }
+
+    virtual Lengths
+    lengths()
+    {
+        // an empty bracket matches nothing, like an empty language
+        Lengths res{ Lengths::kUnbounded, 0 };
+        for (const auto &scope : scopes)
+        {
+            res.min = std::min(res.min, utf8_bytes(scope.first));
+            res.max = std::max(res.max, utf8_bytes(scope.second));
+        }
+        return res;
+    }
+
+    virtual bool
+    single(std::set<Scope> &scopes)
+    {
+        scopes.insert(this->scopes.begin(), this->scopes.end());
+        return true;
+    }
+
+    virtual std::size_t
+    memory_usage()
+    {
+        return sizeof(*this) + scopes.size() * (sizeof(Scope) + 4 * sizeof(void *));
+    }
+
+    virtual bool
+    walk(Submatch &sub, std::size_t pos, const Submatch::Next &next)
+    {
+        char32_t chr;
+        if (!sub.read(pos, chr))
+        {
+            return false;
+        }
+        for (const auto &scope : scopes)
+        {
+            if (scope.first <= chr && chr <= scope.second)
+            {
+                return next(pos);
+            }
+        }
+        return false;
+    }
+};
+
+class SelectNode : public Node
+{
+  private:
+    std::shared_ptr<Node> left;
+    std::shared_ptr<Node> right;
+
+  public:
+    SelectNode(std::shared_ptr<Node> left, std::shared_ptr<Node> right) : left(left), right(right) {}
+
+    // appends the branches of a chain of alternations
+    static void
+    alternatives(const std::shared_ptr<Node> &node, std::vector<std::shared_ptr<Node>> &nodes)
+    {
+        if (auto select = std::dynamic_pointer_cast<SelectNode>(node))
+        {
+            alternatives(select->left, nodes);
+            alternatives(select->right, nodes);
+        }
+        else
+        {
+            nodes.push_back(node);
+        }
+    }
+
+    // alternation of nodes, with common leading characters factored out and single characters folded
+    static std::shared_ptr<Node>
+    select(const std::vector<std::shared_ptr<Node>> &nodes)
+    {
+        std::vector<std::shared_ptr<Node>> merged;
+        std::vector<std::pair<char32_t, std::vector<std::shared_ptr<Node>>>> heads;
+        std::unordered_map<char32_t, std::size_t> head_index;
+        std::vector<std::shared_ptr<Node>> firsts;
+
+        for (const auto &node : nodes)
+        {
+            char32_t chr;
+            std::shared_ptr<Node> rest;
+            if (!node->head(chr, rest))
+            {
+                merged.push_back(node);
+                continue;
+            }
+            if (!head_index.count(chr))
+            {
+                head_index[chr] = heads.size();
+                heads.push_back({ chr, {} });
+                firsts.push_back(node);
+            }
+            heads[head_index[chr]].second.push_back(rest);
+        }
+
+        // a(b|c) for ab|ac, and a(b)? for a|ab
+        for (std::size_t i = 0; i < heads.size(); ++i)
+        {
+            const auto &rests = heads[i].second;
+            if (rests.size() == 1)
+            {
+                merged.push_back(firsts[i]);
+                continue;
+            }
+
+            std::vector<std::shared_ptr<Node>> tails;
+            for (const auto &rest : rests)
+            {
+                if (rest)
+                {
+                    tails.push_back(rest);
+                }
+            }
+
+            std::vector<std::shared_ptr<Node>> operands = { std::make_shared<LeafNode>(heads[i].first) };
+            if (!tails.empty())
+            {
+                auto tail = select(tails);
+                if (tails.size() < rests.size())
+                {
+                    tail = std::make_shared<QualifierNode>(tail, 0, 1);
+                }
+                CatNode::sequence(tail, operands);
+            }
+            merged.push_back(CatNode::concat(operands));
+        }
+
+        // a|[bc]|. becomes one bracket
+        std::set<Scope> scopes;
+        std::vector<std::shared_ptr<Node>> others;
+        for (const auto &node : merged)
+        {
+            if (!node->single(scopes))
+            {
+                others.push_back(node);
+            }
+        }
+        if (others.size() + 1 < merged.size())
+        {
+            std::set<Scope> disjoint;
+            for (auto scope : scopes)
+            {
+                if (!disjoint.empty() && std::prev(disjoint.end())->second >= scope.first)
+                {
+                    scope.first = std::prev(disjoint.end())->first;
+                    scope.second = std::max(scope.second, std::prev(disjoint.end())->second);
+                    disjoint.erase(std::prev(disjoint.end()));
+                }
+                disjoint.insert(scope);
+            }
+            others.push_back(std::make_shared<BracketNode>(disjoint));
+            merged = others;
+        }
+
+        auto res = merged.back();
+        for (auto it = merged.rbegin() + 1; it != merged.rend(); ++it)
+        {
+            res = std::make_shared<SelectNode>(*it, res);
+        }
+        return res;
+    }
+
+    virtual std::shared_ptr<NFAPair>
+    compile()
+    {
+        auto left = this->left->compile();
+        auto right = this->right->compile();
+        auto ptr = std::make_shared<NFAPair>();
+
+        ptr->start->edge_type = NFAState::EdgeType::EPSILON;
+        ptr->end->edge_type = NFAState::EdgeType::EMPTY;
+        ptr->start->next = left->start;
+        ptr->start->next2 = right->start;
+
+        left->end->edge_type = NFAState::EdgeType::EPSILON;
+        right->end->edge_type = NFAState::EdgeType::EPSILON;
+        left->end->next = ptr->end;
+        right->end->next = ptr->end;
+
+        return ptr;
+    }
+
+    virtual Literals
+    literals()
+    {
+        auto left = this->left->literals();
+        auto right = this->right->literals();
+        if (left.exact && right.exact && left.prefix == right.prefix)
+        {
+            return left;
+        }
+
+        Literals res;
+        auto prefix = std::mismatch(left.prefix.begin(), left.prefix.end(), right.prefix.begin(), right.prefix.end());
+        res.prefix.assign(left.prefix.begin(), prefix.first);
+        auto suffix = std::mismatch(left.suffix.rbegin(), left.suffix.rend(), right.suffix.rbegin(), right.suffix.rend());
+        res.suffix.assign(suffix.first.base(), left.suffix.end());
+        res.inner = Literals::longer(res.prefix, res.suffix);
+        return res;
+    }
+
+    virtual Lengths
+    lengths()
+    {
+        auto left = this->left->lengths();
+        auto right = this->right->lengths();
+        return { std::min(left.min, right.min), std::max(left.max, right.max) };
+    }
+
+    virtual std::shared_ptr<Node>
+    simplify()
+    {
+        std::vector<std::shared_ptr<Node>> nodes, simplified;
+        alternatives(left, nodes);
+        alternatives(right, nodes);
+        for (const auto &node : nodes)
+        {
+            alternatives(node->simplify(), simplified);
+        }
+        return select(simplified);
+    }
+
+    virtual std::size_t
+    memory_usage()
+    {
+        return sizeof(*this) + left->memory_usage() + right->memory_usage();
+    }
+
+    virtual bool
+    walk(Submatch &sub, std::size_t pos, const Submatch::Next &next)
+    {
+        return left->walk(sub, pos, next) || right->walk(sub, pos, next);
+    }
+};
+
+class GroupNode : public Node
+{
+  private:
+    std::shared_ptr<Node> content;
+    std::size_t index;
+
+  public:
+    GroupNode(std::shared_ptr<Node> content, std::size_t index) : content(content), index(index) {}
+
+    virtual std::shared_ptr<NFAPair>
+    compile()
+    {
+        return content->compile();
+    }
+
+    virtual Literals
+    literals()
+    {
+        return content->literals();
+    }
+
+    virtual Lengths
+    lengths()
+    {
+        return content->lengths();
+    }
+
+    virtual std::shared_ptr<Node>
+    simplify()
+    {
+        return content->simplify();
+    }
+
+    virtual std::size_t
+    memory_usage()
+    {
+        return sizeof(*this) + content->memory_usage();
+    }
+
+    virtual bool
+    walk(Submatch &sub, std::size_t pos, const Submatch::Next &next)
+    {
+        return content->walk(sub, pos, [&](std::size_t to)
+        {
+            auto saved = sub.groups[index];
+            sub.groups[index] = { pos, to - pos };
+            if (next(to))
+            {
+                return true;
+            }
+            sub.groups[index] = saved;
+            return false;
+        });
+    }
+};
+
+class GroupLocator
+{
+  private:
+    std::shared_ptr<Node> root;
+
+  public:
+    std::size_t groups;
+    std::unordered_map<std::string, std::size_t> names;
+
+    GroupLocator(std::shared_ptr<Node> root, std::size_t groups, std::unordered_map<std::string, std::size_t> names)
+      : root(root), groups(groups), names(names) {}
+
+    std::size_t
+    memory_usage() const
+    {
+        std::size_t bytes = sizeof(*this) + (root ? root->memory_usage() : 0);
+        for (const auto &name : names)
+        {
+            bytes += sizeof(name) + name.first.capacity() + sizeof(void *);
+        }
+        return bytes;
+    }
+
+    // groups 0 ... groups of a match known to be [pos, pos + len) of str
+    std::vector<std::pair<std::size_t, std::size_t>>
+    locate(std::string_view str, std::size_t pos, std::size_t len) const
+    {
+        Submatch sub{ str.substr(0, pos + len), {} };
+        sub.groups.assign(groups + 1, { std::string_view::npos, 0 });
+        if (root)
+        {
+            root->walk(sub, pos, [&](std::size_t to)
+            {
+                return to == pos + len;
+            });
+        }
+        sub.groups[0] = { pos, len };
+        return sub.groups;
+    }
+};
+
+class AhoCorasick
+{
+  private:
+    static constexpr int kRoot = 0;
+    static constexpr int kNone = -1;
+
+    // goto edges of node i are edge_chr/edge_next[edge_begin[i], edge_begin[i + 1]), sorted by chr
+    std::vector<std::size_t> edge_begin;
+    std::vector<char32_t> edge_chr;
+    std::vector<int> edge_next;
+    // the root is hit after every failure, so its ascii row is dense
+    int root_ascii[128];
+
+    std::vector<int> fail;
+    // byte length of the word prefix spelt by each node
+    std::vector<std::size_t> depth;
+    std::vector<bool> accept;
+    std::vector<bool> output;
+
+    int
+    go(int state, char32_t chr) const
+    {
+        if (state == kRoot && chr < 128)
+        {
+            return root_ascii[chr];
+        }
+
+        auto first = edge_chr.begin() + edge_begin[state];
+        auto last = edge_chr.begin() + edge_begin[state + 1];
+        auto it = std::lower_bound(first, last, chr);
+        return (it != last && *it == chr)
+            ? edge_next[it - edge_chr.begin()]
+            : kNone;
+    }
+
+    int
+    step(int state, char32_t chr) const
+    {
+        int next;
+        while ((next = go(state, chr)) == kNone && state != kRoot)
+        {
+            state = fail[state];
+        }
+        return next == kNone ? kRoot : next;
+    }
+
+  public:
+    AhoCorasick(const std::vector<std::u32string> &words)
+    {
+        std::vector<std::map<char32_t, int>> trie(1);
+        accept.push_back(false);
+        depth.push_back(0);
+
+        for (const auto &word : words)
+        {
+            int state = kRoot;
+            for (auto chr : word)
+            {
+                auto it = trie[state].find(chr);
+                if (it == trie[state].end())
+                {
+                    it = trie[state].insert({ chr, static_cast<int>(trie.size()) }).first;
+                    trie.emplace_back();
+                    accept.push_back(false);
+                    depth.push_back(depth[state] + utf8_bytes(chr));
+                }
+                state = it->second;
+            }
+            accept[state] = true;
+        }
+
+        for (const auto &edges : trie)
+        {
+            edge_begin.push_back(edge_chr.size());
+            for (const auto &edge : edges)
+            {
+                edge_chr.push_back(edge.first);
+                edge_next.push_back(edge.second);
+            }
+        }
+        edge_begin.push_back(edge_chr.size());
+
+        std::fill(std::begin(root_ascii), std::end(root_ascii), kNone);
+        for (const auto &edge : trie[kRoot])
+        {
+            if (edge.first < 128)
+            {
+                root_ascii[edge.first] = edge.second;
+            }
+        }
+
+        // breadth first, so fail links always point to finished nodes
+        fail.assign(trie.size(), kRoot);
+        output = accept;
+        std::vector<int> queue = { kRoot };
+        for (std::size_t i = 0; i < queue.size(); ++i)
+        {
+            int state = queue[i];
+            for (const auto &edge : trie[state])
+            {
+                if (state != kRoot)
+                {
+                    fail[edge.second] = step(fail[state], edge.first);
+                }
+                output[edge.second] = accept[edge.second] || output[fail[edge.second]];
+                queue.push_back(edge.second);
+            }
+        }
+    }
+
+    // length of the longest word which is a prefix of reading, same rules as walking a DFA
+    std::size_t
+    match(const char32_t *reading, bool end) const
+    {
+        std::size_t res = 0;
+        int state = kRoot;
+
+        for (std::size_t i = 0; reading[i]; ++i)
+        {
+            state = go(state, reading[i]);
+            if (state == kNone)
+            {
+                return end ? 0 : res;
+            }
+            if (accept[state])
+            {
+                res = i + 1;
+            }
+        }
+
+        return res;
+    }
+
+    // byte length of the longest word which is a prefix of str, npos if there is none
+    std::size_t
+    match(std::string_view str, bool end) const
+    {
+        auto reading = reinterpret_cast<const unsigned char *>(str.data());
+        auto first = reading, last = reading + str.size();
+        auto res = std::string_view::npos;
+        int state = kRoot;
+        char32_t chr;
+
+        while (read_utf8(reading, last, chr))
+        {
+            state = go(state, chr);
+            if (state == kNone)
+            {
+                return end ? std::string_view::npos : res;
+            }
+            if (accept[state])
+            {
+                res = reading - first;
+            }
+        }
+
+        return res;
+    }
+
+    std::size_t
+    memory_usage() const
+    {
+        return sizeof(*this) + edge_begin.capacity() * sizeof(edge_begin[0]) + edge_chr.capacity() * sizeof(edge_chr[0])
+             + edge_next.capacity() * sizeof(edge_next[0]) + fail.capacity() * sizeof(fail[0])
+             + depth.capacity() * sizeof(depth[0]) + (accept.capacity() + output.capacity()) / 8;
+    }
+
+    // byte lengths of the shortest and the longest word
+    Lengths
+    lengths() const
+    {
+        Lengths res{ Lengths::kUnbounded, 0 };
+        for (std::size_t state = 0; state < accept.size(); ++state)
+        {
+            if (accept[state])
+            {
+                res.min = std::min(res.min, depth[state]);
+                res.max = std::max(res.max, depth[state]);
+            }
+        }
+        return res;
+    }
+
+    // leftmost-longest occurrence at or after from as (position, length), position is npos if there is none
+    std::pair<std::size_t, std::size_t>
+    search(std::string_view str, std::size_t from, bool end) const
+    {
+        auto first = reinterpret_cast<const unsigned char *>(str.data());
+        auto last = first + str.size();
+        int state = kRoot;
+
+        for (auto reading = first + from; reading != last;)
+        {
+            char32_t chr;
+            if (!read_utf8(reading, last, chr))
+            {
+                // bytes str_to_utf8 would stop at are never part of a match
+                ++reading;
+                state = kRoot;
+                continue;
+            }
+
+            state = step(state, chr);
+            if (end || !output[state])
+            {
+                continue;
+            }
+
+            // no match can start before the longest live suffix, so try those positions in order
+            std::size_t stop = reading - first;
+            for (auto pos = stop - depth[state]; pos < stop; pos += utf8_length(first[pos]))
+            {
+                auto len = match(str.substr(pos), false);
+                if (len != std::string_view::npos)
+                {
+                    return { pos, len };
+                }
+            }
+        }
+
+        if (end)
+        {
+            // a match has to reach the end of str, so only suffixes still alive in the trie qualify
+            for (; state != kRoot; state = fail[state])
+            {
+                auto pos = str.size() - depth[state];
+                auto len = match(str.substr(pos), true);
+                if (len != std::string_view::npos)
+                {
+                    return { pos, len };
+                }
+            }
+        }
+
+        return { std::string_view::npos, 0 };
+    }
+};
+
+// a literal which every match contains, lets a search skip to where a match can end at the earliest
+class RequiredLiteral
+{
+  private:
+    using Searcher = std::boyer_moore_horspool_searcher<std::string::const_iterator>;
+    // shorter literals are found with memchr, which beats the shift table the searcher needs
+    static constexpr std::size_t kMinSearcherSize = 4;
+
+    std::string literal;
+    std::unique_ptr<Searcher> searcher;
+
+  public:
+    RequiredLiteral(const std::string &literal) : literal(literal)
+    {
+        if (literal.size() >= kMinSearcherSize)
+        {
+            searcher = std::make_unique<Searcher>(this->literal.begin(), this->literal.end());
+        }
+    }
+
+    std::size_t
+    size() const
+    {
+        return literal.size();
+    }
+
+    std::size_t
+    memory_usage() const
+    {
+        return sizeof(*this) + literal.capacity() + (searcher ? sizeof(Searcher) : 0);
+    }
+
+    // position of the first occurrence at or after from, npos if there is none
+    std::size_t
+    find(std::string_view str, std::size_t from) const
+    {
+        if (from >= str.size())
+        {
+            return std::string_view::npos;
+        }
+        if (!searcher)
+        {
+            return str.find(literal, from);
+        }
+
+        auto found = std::search(str.begin() + from, str.end(), *searcher);
+        return found == str.end() ? std::string_view::npos : found - str.begin();
+    }
+};
+
+// walks an NFA with the set of states it can be in, slower per byte than a DFA but ready as soon as the
+// NFA is, so it can match while the DFA is still being built
+class NFASimulator
+{
+  private:
+    // per state: the characters leading to next for a CCL state, next and next2 for an EPSILON state
+    std::vector<NFAState::EdgeType> types;
+    std::vector<std::vector<Scope>> scopes;
+    std::vector<std::uint32_t> next, next2;
+    std::uint32_t final_state = 0;
+
+  public:
+    static constexpr std::uint32_t kNone = std::numeric_limits<std::uint32_t>::max();
+
+    // takes over the NFA and breaks its cycles once its states are numbered
+    NFASimulator(std::shared_ptr<NFAPair> nfa)
+    {
+        std::vector<NFAState *> states;
+        std::unordered_map<NFAState *, std::uint32_t> ids = { { nfa->start.get(), 0 } };
+        for (std::vector<NFAState *> stack = { nfa->start.get() }; !stack.empty();)
+        {
+            auto state = stack.back();
+            stack.pop_back();
+            ids[state] = states.size();
+            states.push_back(state);
+            for (auto target : { state->next.get(), state->next2.get() })
+            {
+                if (target && ids.emplace(target, 0).second)
+                {
+                    stack.push_back(target);
+                }
+            }
+        }
+
+        for (auto state : states)
+        {
+            types.push_back(state->edge_type);
+            scopes.emplace_back(state->scopes.begin(), state->scopes.end());
+            next.push_back(state->next ? ids[state->next.get()] : kNone);
+            next2.push_back(state->next2 ? ids[state->next2.get()] : kNone);
+        }
+        final_state = ids.count(nfa->end.get()) ? ids[nfa->end.get()] : kNone;
+
+        std::vector<NFAPtr> owned;
+        for (auto state : states)
+        {
+            owned.push_back(std::move(state->next));
+            owned.push_back(std::move(state->next2));
+        }
+    }
+
+    std::size_t
+    memory_usage() const
+    {
+        std::size_t res = sizeof(*this) + types.capacity() * sizeof(types[0])
+            + scopes.capacity() * sizeof(scopes[0]) + (next.capacity() + next2.capacity()) * sizeof(std::uint32_t);
+        for (const auto &scope : scopes)
+        {
+            res += scope.capacity() * sizeof(Scope);
+        }
+        return res;
+    }
+
+    // same as DFATable::match
+    std::size_t
+    match(std::string_view str, bool end) const
+    {
+        std::vector<std::uint32_t> current, following, pending, marks(types.size(), 0);
+        std::uint32_t mark = 0;
+        bool accepted = false;
+
+        // adds the epsilon closure of state to into, accepted tells whether it holds the final state
+        auto close = [&](std::uint32_t state, std::vector<std::uint32_t> &into)
+        {
+            pending.push_back(state);
+            while (!pending.empty())
+            {
+                auto id = pending.back();
+                pending.pop_back();
+                if (id == kNone || marks[id] == mark)
+                {
+                    continue;
+                }
+                marks[id] = mark;
+                accepted = accepted || id == final_state;
+                if (types[id] == NFAState::EdgeType::EPSILON)
+                {
+                    pending.push_back(next2[id]);
+                    pending.push_back(next[id]);
+                }
+                else if (types[id] == NFAState::EdgeType::CCL)
+                {
+                    into.push_back(id);
+                }
+            }
+        };
+
+        ++mark;
+        close(0, current);
+        auto res = accepted ? 0 : std::string_view::npos;
+        auto first = reinterpret_cast<const unsigned char *>(str.data());
+        auto reading = first, last = first + str.size();
+        char32_t chr;
+
+        while (read_utf8(reading, last, chr))
+        {
+            ++mark;
+            accepted = false;
+            following.clear();
+            for (auto id : current)
+            {
+                auto in = std::find_if(scopes[id].begin(), scopes[id].end(), [chr](const Scope &scope)
+                {
+                    return scope.first <= chr && chr <= scope.second;
+                });
+                if (in != scopes[id].end())
+                {
+                    close(next[id], following);
+                }
+            }
+            if (following.empty() && !accepted)
+            {
+                return end ? std::string_view::npos : res;
+            }
+            if (accepted)
+            {
+                res = reading - first;
+            }
+            current.swap(following);
+        }
+        return res;
+    }
+
+    // the leftmost non-empty match at or after from, the longest one there, as (position, length), (npos, 0)
+    // if there is none, the same one as match tried at every start; the sets of states a start can be in are
+    // numbered as they turn up and their moves cached, a DFA built only as far as str needs, and the starts
+    // in the same set go on as the earliest of them, so each byte costs at most one move per set
+    std::pair<std::size_t, std::size_t>
+    find(std::string_view str, std::size_t from, bool begin, bool end) const
+    {
+        using Found = std::pair<std::size_t, std::size_t>;
+        struct Thread
+        {
+            std::uint32_t set;
+            std::size_t start;
+            Found found;
+        };
+
+        constexpr auto npos = std::string_view::npos;
+        // the members of set k are members[offsets[k]] ... members[offsets[k + 1] - 1], set 0 is the empty one
+        std::vector<std::uint32_t> members, offsets = { 0, 0 }, seeds, pending, marks(types.size(), 0), set;
+        std::vector<bool> accepting = { false };
+        std::map<std::vector<std::uint32_t>, std::uint32_t> numbers = { { {}, 0 } };
+        std::unordered_map<std::uint64_t, std::uint32_t> moves;
+        std::uint32_t mark = 0;
+
+        // the number of the epsilon closure of seeds, holding its CCL states and the final state
+        auto number = [&]()
+        {
+            ++mark;
+            set.clear();
+            pending.assign(seeds.begin(), seeds.end());
+            while (!pending.empty())
+            {
+                auto id = pending.back();
+                pending.pop_back();
+                if (id == kNone || marks[id] == mark)
+                {
+                    continue;
+                }
+                marks[id] = mark;
+                if (types[id] == NFAState::EdgeType::EPSILON)
+                {
+                    pending.push_back(next2[id]);
+                    pending.push_back(next[id]);
+                }
+                if (types[id] == NFAState::EdgeType::CCL || id == final_state)
+                {
+                    set.push_back(id);
+                }
+            }
+            std::sort(set.begin(), set.end());
+            auto numbered = numbers.emplace(set, static_cast<std::uint32_t>(accepting.size()));
+            if (numbered.second)
+            {
+                members.insert(members.end(), set.begin(), set.end());
+                offsets.push_back(members.size());
+                accepting.push_back(std::binary_search(set.begin(), set.end(), final_state));
+            }
+            return numbered.first->second;
+        };
+
+        auto step = [&](std::uint32_t source, char32_t chr)
+        {
+            auto key = static_cast<std::uint64_t>(source) << 32 | chr;
+            auto cached = moves.find(key);
+            if (cached != moves.end())
+            {
+                return cached->second;
+            }
+            seeds.clear();
+            for (auto k = offsets[source]; k < offsets[source + 1]; ++k)
+            {
+                auto id = members[k];
+                if (types[id] == NFAState::EdgeType::CCL && std::any_of(scopes[id].begin(), scopes[id].end(),
+                    [chr](const Scope &scope) { return scope.first <= chr && chr <= scope.second; }))
+                {
+                    seeds.push_back(next[id]);
+                }
+            }
+            return moves.emplace(key, number()).first->second;
+        };
+
+        // leftmost first, then longest
+        auto before = [](const Found &lhs, const Found &rhs)
+        {
+            return lhs.first < rhs.first || (lhs.first == rhs.first && lhs.second > rhs.second);
+        };
+
+        seeds.assign(1, 0);
+        auto start = number();
+        std::vector<Thread> threads, moved;
+        std::vector<std::uint32_t> owner;
+        Found res = { npos, 0 };
+        auto first = reinterpret_cast<const unsigned char *>(str.data()), last = first + str.size();
+        bool spawning = true;
+        char32_t chr;
+
+        for (auto pos = from;;)
+        {
+            spawning = spawning && !(begin && pos);
+            // without end a match stays once found, so the starts after the leftmost one can not win any more
+            if (!end)
+            {
+                auto leftmost = res.first;
+                for (const auto &thread : threads)
+                {
+                    leftmost = std::min(leftmost, thread.found.first);
+                }
+                if (leftmost != npos)
+                {
+                    spawning = false;
+                    while (!threads.empty() && threads.back().start > leftmost)
+                    {
+                        threads.pop_back();
+                    }
+                }
+            }
+            if (spawning && pos < str.size())
+            {
+                threads.push_back({ start, pos, { npos, 0 } });
+            }
+            if (threads.empty())
+            {
+                return res;
+            }
+
+            auto reading = first + pos;
+            if (!read_utf8(reading, last, chr))
+            {
+                // every attempt stops here and keeps the longest match it has
+                for (const auto &thread : threads)
+                {
+                    res = before(thread.found, res) ? thread.found : res;
+                }
+                threads.clear();
+                if (res.first != npos || pos == str.size())
+                {
+                    return res;
+                }
+                pos += std::max<std::size_t>(1, utf8_length(str[pos]));
+                continue;
+            }
+
+            moved.clear();
+            for (auto &thread : threads)
+            {
+                auto target = step(thread.set, chr);
+                if (!target)
+                {
+                    // an attempt that dies before the end has no match when the pattern ends with $
+                    res = !end && before(thread.found, res) ? thread.found : res;
+                    continue;
+                }
+                if (accepting[target])
+                {
+                    thread.found = { thread.start, reading - first - thread.start };
+                }
+                owner.resize(std::max(owner.size(), accepting.size()), 0);
+                if (owner[target])
+                {
+                    auto &earlier = moved[owner[target] - 1];
+                    earlier.found = before(thread.found, earlier.found) ? thread.found : earlier.found;
+                    continue;
+                }
+                moved.push_back({ target, thread.start, thread.found });
+                owner[target] = moved.size();
+            }
+            for (const auto &thread : moved)
+            {
+                owner[thread.set] = 0;
+            }
+            threads.swap(moved);
+            pos = reading - first;
+        }
+    }
+};
+
+// how product combines the two DFAs
+enum class Combine
+{
+    INTERSECT, UNITE, SUBTRACT
+};
+
+// a minimal DFA for the dense one given by next, with bounds.size() classes starting at bounds, where state 0
+// is dead and stands for every state which is not live
+inline std::shared_ptr<DFATable>
+minimal(const std::vector<char32_t> &bounds, const std::vector<std::uint32_t> &next, const std::vector<bool> &accepting,
+        std::uint32_t start)
+{
+    auto classes = bounds.size(), count = accepting.size();
+
+    // Moore's refinement, states stay together while their acceptance and the blocks they lead to agree
+    std::vector<std::uint32_t> block(count);
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        block[i] = i && accepting[i];
+    }
+    for (std::size_t blocks = 0;;)
+    {
+        std::map<std::vector<std::uint32_t>, std::uint32_t> signatures;
+        std::vector<std::uint32_t> refined(count);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            std::vector<std::uint32_t> signature = { block[i] };
+            for (std::size_t k = 0; k < classes; ++k)
+            {
+                signature.push_back(block[next[i * classes + k]]);
+            }
+            refined[i] = signatures.insert({ signature, static_cast<std::uint32_t>(signatures.size()) }).first->second;
+        }
+        block.swap(refined);
+        if (signatures.size() == blocks)
+        {
+            break;
+        }
+        blocks = signatures.size();
+    }
+
+    // one DFAState per block but the dead one, with the runs of classes leading to the same block merged
+    std::map<std::uint32_t, DFAPtr> states;
+    auto state_of = [&](std::uint32_t i)
+    {
+        auto &state = states[block[i]];
+        if (!state)
+        {
+            state = std::make_shared<DFAState>(block[i] != block[0] && accepting[i]
+                ? DFAState::State::END
+                : DFAState::State::NORMAL);
+        }
+        return state;
+    };
+    auto dfa = state_of(start);
+    std::set<std::uint32_t> done;
+    for (std::size_t i = 1; i < count; ++i)
+    {
+        if (block[i] == block[0] || !done.insert(block[i]).second)
+        {
+            continue;
+        }
+        auto state = state_of(i);
+        for (std::size_t k = 0; k < classes; ++k)
+        {
+            auto target = next[i * classes + k];
+            if (block[target] == block[0])
+            {
+                continue;
+            }
+            auto last = k;
+            while (last + 1 < classes && block[next[i * classes + last + 1]] == block[target])
+            {
+                ++last;
+            }
+            state->scope_state[{ bounds[k], last + 1 < classes ? bounds[last + 1] - 1 : kChar32Max }] = state_of(target);
+            k = last;
+        }
+    }
+
+    auto table = std::make_shared<DFATable>(dfa);
+    release(dfa);
+    return table;
+}
+
+// a minimal DFA accepting what a and b accept combined by op, whose states are the pairs of their states
+inline std::shared_ptr<DFATable>
+product(const DFATable &a, const DFATable &b, Combine op)
+{
+    // the classes of both tables, split wherever either one splits
+    std::vector<char32_t> bounds;
+    for (std::size_t k = 0; k < a.classes; ++k)
+    {
+        bounds.push_back(a.class_scope(k).first);
+    }
+    for (std::size_t k = 0; k < b.classes; ++k)
+    {
+        bounds.push_back(b.class_scope(k).first);
+    }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+    auto classes = bounds.size();
+
+    auto live = [op](std::uint32_t x, std::uint32_t y)
+    {
+        return op == Combine::INTERSECT ? x && y : op == Combine::UNITE ? x || y : x != 0;
+    };
+    auto accepts = [op](bool x, bool y)
+    {
+        return op == Combine::INTERSECT ? x && y : op == Combine::UNITE ? x || y : x && !y;
+    };
+
+    // the reachable pairs, 0 is the dead state and stands for every pair which is not live
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> pairs = { { 0, 0 } };
+    std::map<std::pair<std::uint32_t, std::uint32_t>, std::uint32_t> ids;
+    std::vector<std::uint32_t> next(classes, 0);
+    auto id_of = [&](std::uint32_t x, std::uint32_t y)
+    {
+        if (!live(x, y))
+        {
+            return std::uint32_t(0);
+        }
+        auto found = ids.insert({ { x, y }, static_cast<std::uint32_t>(pairs.size()) });
+        if (found.second)
+        {
+            pairs.push_back({ x, y });
+            next.resize(next.size() + classes, 0);
+        }
+        return found.first->second;
+    };
+    auto start = id_of(a.start, b.start);
+    for (std::size_t i = 1; i < pairs.size(); ++i)
+    {
+        for (std::size_t k = 0; k < classes; ++k)
+        {
+            auto x = a.next[pairs[i].first * a.classes + a.class_of(bounds[k])];
+            auto y = b.next[pairs[i].second * b.classes + b.class_of(bounds[k])];
+            auto target = id_of(x, y);
+            next[i * classes + k] = target;
+        }
+    }
+
+    std::vector<bool> accepting(pairs.size());
+    for (std::size_t i = 1; i < pairs.size(); ++i)
+    {
+        accepting[i] = accepts(a.accept[pairs[i].first], b.accept[pairs[i].second]);
+    }
+    return minimal(bounds, next, accepting, start);
+}
+
+// a minimal DFA accepting what table accepts with any text before it if before is set and any text after it
+// if after is set, as .* around the pattern would; its states are the sets of states of table the text may
+// have led to, and one state for after an accepted prefix, which accepts everything
+inline std::shared_ptr<DFATable>
+widen(const DFATable &table, bool before, bool after)
+{
+    std::vector<char32_t> bounds;
+    for (std::size_t k = 0; k < table.classes; ++k)
+    {
+        bounds.push_back(table.class_scope(k).first);
+    }
+    auto classes = bounds.size();
+
+    // state 0 is dead and state 1 is the one past an accepted prefix
+    std::vector<std::vector<std::uint32_t>> sets = { {}, {} };
+    std::map<std::vector<std::uint32_t>, std::uint32_t> ids;
+    std::vector<std::uint32_t> next(2 * classes, 0);
+    std::fill(next.begin() + classes, next.end(), after ? 1 : 0);
+    auto id_of = [&](std::vector<std::uint32_t> set)
+    {
+        std::sort(set.begin(), set.end());
+        set.erase(std::unique(set.begin(), set.end()), set.end());
+        set.erase(std::remove(set.begin(), set.end(), DFATable::kDead), set.end());
+        if (set.empty())
+        {
+            return std::uint32_t(0);
+        }
+        if (after && std::any_of(set.begin(), set.end(), [&table](std::uint32_t state) { return table.accept[state]; }))
+        {
+            return std::uint32_t(1);
+        }
+        auto found = ids.insert({ set, static_cast<std::uint32_t>(sets.size()) });
+        if (found.second)
+        {
+            sets.push_back(set);
+            next.resize(next.size() + classes, 0);
+        }
+        return found.first->second;
+    };
+    auto start = id_of({ table.start });
+    for (std::size_t i = 2; i < sets.size(); ++i)
+    {
+        for (std::size_t k = 0; k < classes; ++k)
+        {
+            std::vector<std::uint32_t> targets;
+            if (before)
+            {
+                targets.push_back(table.start);
+            }
+            for (auto state : sets[i])
+            {
+                targets.push_back(table.next[state * classes + k]);
+            }
+            auto target = id_of(targets);
+            next[i * classes + k] = target;
+        }
+    }
+
+    std::vector<bool> accepting(sets.size());
+    accepting[1] = after;
+    for (std::size_t i = 2; i < sets.size(); ++i)
+    {
+        for (auto state : sets[i])
+        {
+            accepting[i] = accepting[i] || table.accept[state];
+        }
+    }
+    return minimal(bounds, next, accepting, start);
+}
+
+// bounds of the byte length of the strings table accepts, from the bytes of the characters of each class
+inline Lengths
+lengths_of(const DFATable &table)
+{
+    auto states = table.states();
+    std::vector<std::vector<std::uint32_t>> from(states);
+    for (std::uint32_t i = 1; i < states; ++i)
+    {
+        for (std::size_t k = 0; k < table.classes; ++k)
+        {
+            from[table.next[i * table.classes + k]].push_back(i);
+        }
+    }
+
+    // the states which lead to an accepting one, only paths through them count
+    std::vector<bool> useful(states, false);
+    std::vector<std::uint32_t> pending;
+    for (std::uint32_t i = 1; i < states; ++i)
+    {
+        if (table.accept[i])
+        {
+            useful[i] = true;
+            pending.push_back(i);
+        }
+    }
+    while (!pending.empty())
+    {
+        auto i = pending.back();
+        pending.pop_back();
+        for (auto j : from[i])
+        {
+            if (!useful[j])
+            {
+                useful[j] = true;
+                pending.push_back(j);
+            }
+        }
+    }
+
+    // nothing is accepted, so no input is long enough
+    Lengths res{ Lengths::kUnbounded, 0 };
+    if (!useful[table.start])
+    {
+        return res;
+    }
+
+    // the shortest path to an accepting state, and the longest unless a loop is on the way
+    std::vector<std::size_t> shortest(states, Lengths::kUnbounded), longest(states, 0);
+    std::vector<std::uint8_t> visiting(states, 0);
+    std::function<bool(std::uint32_t)> walk = [&](std::uint32_t i)
+    {
+        // 1 while on the path, 2 when done
+        if (visiting[i] == 1)
+        {
+            return false;
+        }
+        if (visiting[i] == 2)
+        {
+            return true;
+        }
+        visiting[i] = 1;
+        shortest[i] = table.accept[i] ? 0 : Lengths::kUnbounded;
+        longest[i] = 0;
+        for (std::size_t k = 0; k < table.classes; ++k)
+        {
+            auto target = table.next[i * table.classes + k];
+            if (!target || !useful[target])
+            {
+                continue;
+            }
+            if (!walk(target))
+            {
+                return false;
+            }
+            auto scope = table.class_scope(k);
+            shortest[i] = std::min(shortest[i], Lengths::add(shortest[target], utf8_bytes(scope.first)));
+            longest[i] = std::max(longest[i], longest[target] + utf8_bytes(scope.second));
+        }
+        visiting[i] = 2;
+        return true;
+    };
+    if (walk(table.start))
+    {
+        return { shortest[table.start], longest[table.start] };
+    }
+
+    // a loop, so only the shortest path is bounded
+    std::set<std::pair<std::size_t, std::uint32_t>> queue = { { 0, table.start } };
+    std::fill(shortest.begin(), shortest.end(), Lengths::kUnbounded);
+    shortest[table.start] = 0;
+    while (!queue.empty())
+    {
+        auto top = *queue.begin();
+        queue.erase(queue.begin());
+        if (table.accept[top.second])
+        {
+            res.min = top.first;
+            break;
+        }
+        for (std::size_t k = 0; k < table.classes; ++k)
+        {
+            auto target = table.next[top.second * table.classes + k];
+            auto length = top.first + utf8_bytes(table.class_scope(k).first);
+            if (target && useful[target] && length < shortest[target])
+            {
+                queue.erase({ shortest[target], target });
+                shortest[target] = length;
+                queue.insert({ length, target });
+            }
+        }
+    }
+    res.max = Lengths::kUnbounded;
+    return res;
+}
+
+class Parse
+{
+  private:
+    bool begin = false;
+    bool end   = false;
+    std::unordered_map<std::string, std::shared_ptr<Node>> ref_map;
+    std::size_t groups = 0;
+    std::unordered_map<std::string, std::size_t> group_names;
+    std::shared_ptr<Node> root;
+
+    char32_t
+    translate_escape_chr(const char32_t *&reading)
+    {
+        ++reading;
+        if (*reading)
+        {
+            switch (*reading)
+            {
+            case '0':
+                return '\0';
+            case 'a':
+                return '\a';
+            case 'b':
+                return '\b';
+            case 't':
+                return '\t';
+            case 'n':
+                return '\n';
+            case 'v':
+                return '\v';
+            case 'f':
+                return '\f';
+            case 'r':
+                return '\r';
+            case 'e':
+                return '\e';
+            case 'c':
+                if (*(reading + 1) && (isalpha(*(reading + 1)) || (*(reading + 1) > 63 && *(reading + 1) < 94)))
+                {
+                    ++reading;
+                    return toupper(*reading) - 64;
+                }
+                else
+                {
+                    return 'c';
+                }
+            default:
+                return *reading;
+            }
+        }
+        else
+        {
+            return kChar32Max;
+        }
+    }
+
+    std::set<Scope>
+    translate_echr2scopes(char32_t &left, const char32_t *&reading, bool range)
+    {
+        auto res = translate_escape_chr(reading);
+        std::set<Scope> ret;
+        if (ECMAP.count(res))
+        {
+            ret = ECMAP[res];
+        }
+        else
+        {
+            left = res;
+        }
+        if (!range && ECMAP.count(res))
+        {
+            left = kChar32Max;
+        }
+        return ret;
+    }
+
+    std::shared_ptr<Node>
+    translate_echr2node(const char32_t *&reading)
+    {
+        std::shared_ptr<Node> node = nullptr;
+        char32_t left = kChar32Max;
+        auto res = translate_echr2scopes(left, reading, false);
+        if (left == kChar32Max)
+        {
+            node = std::make_shared<BracketNode>(res);
+        }
+        else
+        {
+            node = std::make_shared<LeafNode>(left);
+        }
+        return node;
+    }
+
+    std::shared_ptr<Node>
+    gen_bracket(const char32_t *&reading)
+    {
+        char32_t left = kChar32Max;
+        bool range = false, exclude = false;
+        std::set<Scope> scopes;
+
+        if (*reading == '^')
+        {
+            ++reading;
+            exclude = true;
+        }
+        if (*reading == ']')
+        {
+            return std::make_shared<BracketNode>(scopes);
+        }
+
+        while (*reading && *reading != ']')
+        {
+            if (*reading == '-')
+            {
+                if (!range && left != kChar32Max)
+                {
+                    range = true;
+                }
+            }
+            else if (range)
+            {
+                if (*reading == '\\')
+                {
+                    auto res = translate_echr2scopes(left, reading, true);
+                    scopes.insert(res.begin(), res.end());
+                }
+                else
+                {
+                    scopes.insert({ left, *reading });
+                }
+                left = kChar32Max;
+                range = false;
+            }
+            else
+            {
+                if (left != kChar32Max)
+                {
+                    scopes.insert({ left, left });
+                }
+                if (*reading == '\\')
+                {
+                    auto res = translate_echr2scopes(left, reading, false);
+                    scopes.insert(res.begin(), res.end());
+                }
+                else
+                {
+                    left = *reading;
+                }
+            }
+            ++reading;
+        }
+
+        if (left != kChar32Max)
+        {
+            scopes.insert({ left, left });
+        }
+
+        if (exclude)
+        {
+            std::vector<Scope> sorted_scopes(scopes.begin(), scopes.end());
+            std::sort(sorted_scopes.begin(), sorted_scopes.end(), [](Scope a, Scope b)
+            {
+                return a.first < b.first;
+            });
+
+            decltype(scopes) temp;
+            char32_t start = kChar32Min;
+            for (auto scope : sorted_scopes)
+            {
+                if (start < scope.first)
+                {
+                    temp.insert({ start, scope.first - 1 });
+                    start = scope.second + 1;
+                }
+                else if (scope.second >= start)
+                {
+                    start = scope.second + 1;
+                }
+            }
+            temp.insert({ start, kChar32Max });
+
+            scopes = temp;
+        }
+
+        return std::make_shared<BracketNode>(scopes);
+    }
+
+    std::shared_ptr<Node>
+    gen_subexpr(const char32_t *&reading)
+    {
+        std::shared_ptr<Node> node = nullptr;
+        if (*reading == '?')
+        {
+            ++reading;
+            if (*reading == ':')
+            {
+                ++reading;
+            }
+            if (*reading == '<')
+            {
+                ++reading;
+            }
+            std::string name;
+            while (isalnum(*reading) || *reading == '_')
+            {
+                name += *reading++;
+            }
+            if (*reading == '>')
+            {
+                ++reading;
+            }
+            if (*reading == ')')
+            {
+                if (ref_map.count(name))
+                {
+                    return ref_map[name];
+                }
+            }
+            else
+            {
+                auto index = name.empty() ? 0 : ++groups;
+                node = gen_node(reading);
+                if (node && index)
+                {
+                    node = std::make_shared<GroupNode>(node, index);
+                    group_names[name] = index;
+                }
+                ref_map[name] = node;
+            }
+        }
+        else
+        {
+            auto index = ++groups;
+            node = gen_node(reading);
+            if (node)
+            {
+                node = std::make_shared<GroupNode>(node, index);
+            }
+        }
+        return node;
+    }
+
+    std::shared_ptr<Node>
+    gen_node(const char32_t *&reading)
+    {
+        std::shared_ptr<Node> node = nullptr, right = nullptr;
+
+        if (*reading == '^')
+        {
+            ++reading;
+            begin = true;
+        }
+
+        if (*reading == '(')
+        {
+            ++reading;
+            node = gen_subexpr(reading);
+        }
+        else if (*reading == '[')
+        {
+            ++reading;
+            node = gen_bracket(reading);
+        }
+        else if (*reading == '.')
+        {
+            node = std::make_shared<DotNode>();
+        }
+        else if (*reading && *reading != '|' && *reading != ')')
+        {
+            node = *reading == '\\'
+                ? translate_echr2node(reading)
+                : std::make_shared<LeafNode>(*reading);
+        }
+
+        if (!node)
+        {
+            return node;
+        }
+        ++reading;
+
+        while (*reading && *reading != '|' && *reading != ')' && *reading != '$')
+        {
+            switch (*reading)
+            {
+            case '(':
+                ++reading;
+                if (right)
+                {
+                    node = std::make_shared<CatNode>(node, right);
+                }
+                right = gen_subexpr(reading);
+                break;
+            case '[':
+                ++reading;
+                if (right)
+                {
+                    node = std::make_shared<CatNode>(node, right);
+                }
+                right = gen_bracket(reading);
+                break;
+            case '{':
+                ++reading;
+                if (*reading < 0x80 && std::isdigit(*reading))
+                {
+                    int n = *reading - '0', m = -2;
+                    ++reading;
+                    if (*reading == ',')
+                    {
+                        ++reading;
+                        m = *reading < 0x80 && std::isdigit(*reading)
+                            ? *reading++ - '0'
+                            : -1;
+                    }
+
+                    if (right)
+                    {
+                        right = std::make_shared<QualifierNode>(right, n, m);
+                    }
+                    else
+                    {
+                        node = std::make_shared<QualifierNode>(node, n, m);
+                    }
+                }
+                break;
+            case '*':
+                if (right)
+                {
+                    right = std::make_shared<ClosureNode>(right);
+                }
+                else
+                {
+                    node = std::make_shared<ClosureNode>(node);
+                }
+                break;
+            case '+':
+                if (right)
+                {
+                    right = std::make_shared<QualifierNode>(right, 1, -1);
+                }
+                else
+                {
+                    node = std::make_shared<QualifierNode>(node, 1, -1);
+                }
+                break;
+            case '?':
+                if (right)
+                {
+                    right = std::make_shared<QualifierNode>(right, 0, 1);
+                }
+                else
+                {
+                    node = std::make_shared<QualifierNode>(node, 0, 1);
+                }
+                break;
+            case '.':
+                if (right)
+                {
+                    node = std::make_shared<CatNode>(node, right);
+                }
+                right = std::make_shared<DotNode>();
+                break;
+            default:
+                if (right)
+                {
+                    node = std::make_shared<CatNode>(node, right);
+                }
+                right = *reading == '\\'
+                    ? translate_echr2node(reading)
+                    : std::make_shared<LeafNode>(*reading);
+                break;
+            }
+            ++reading;
+        }
+
+        if (*reading == '|')
+        {
+            ++reading;
+            if (right)
+            {
+                node = std::make_shared<CatNode>(node, right);
+            }
+            node = std::make_shared<SelectNode>(node, gen_node(reading));
+        }
+        else if (right)
+        {
+            node = std::make_shared<CatNode>(node, right);
+        }
+
+        if (*reading == '$')
+        {
+            ++reading;
+            end = true;
+        }
+        return node;
+    }
+
+  public:
+    Parse() {}
+
+    // the first syntax error of the expression as "<what> at character <index>", empty if it has none;
+    // gen_dfa and gen_nfa read past such errors as best they can, this is for callers which reject them
+    static std::string
+    check(const char32_t *reading)
+    {
+        auto first = reading;
+        auto error = [first](const char *what, const char32_t *at)
+        {
+            return std::string(what) + " at character " + std::to_string(at - first);
+        };
+        auto digit = [](char32_t chr) { return chr < 0x80 && std::isdigit(chr); };
+        std::vector<const char32_t *> opened;
+        // whether there is something before reading a quantifier can repeat
+        bool operand = false;
+
+        for (; *reading; ++reading)
+        {
+            switch (*reading)
+            {
+            case '\\':
+                if (!*(reading + 1))
+                {
+                    return error("dangling \\", reading);
+                }
+                ++reading;
+                operand = true;
+                break;
+            case '[':
+            {
+                auto at = reading++;
+                if (*reading == '^')
+                {
+                    ++reading;
+                }
+                while (*reading && *reading != ']')
+                {
+                    reading += *reading == '\\' && *(reading + 1) ? 2 : 1;
+                }
+                if (!*reading)
+                {
+                    return error("unterminated [", at);
+                }
+                operand = true;
+                break;
+            }
+            case '(':
+                opened.push_back(reading);
+                if (*(reading + 1) == '?')
+                {
+                    // (?:<name>...) and (?:<name>) are groups, the '?' repeats nothing
+                    ++reading;
+                    if (*(reading + 1) == ':')
+                    {
+                        ++reading;
+                    }
+                    if (*(reading + 1) == '<')
+                    {
+                        ++reading;
+                    }
+                    while (*(reading + 1) < 0x80 && (std::isalnum(*(reading + 1)) || *(reading + 1) == '_'))
+                    {
+                        ++reading;
+                    }
+                    if (*(reading + 1) == '>')
+                    {
+                        ++reading;
+                    }
+                }
+                operand = false;
+                break;
+            case ')':
+                if (opened.empty())
+                {
+                    return error("unbalanced )", reading);
+                }
+                opened.pop_back();
+                operand = true;
+                break;
+            case '|':
+                operand = false;
+                break;
+            case '^':
+                // an anchor at the start of a branch, a plain character elsewhere
+                break;
+            case '*': case '+': case '?':
+                if (!operand)
+                {
+                    return error("nothing to repeat", reading);
+                }
+                break;
+            case '{':
+            {
+                // {n}, {n,} or {n,m} with single digits and n <= m
+                auto at = reading;
+                if (!operand)
+                {
+                    return error("nothing to repeat", at);
+                }
+                if (!digit(*++reading))
+                {
+                    return error("bad quantifier", at);
+                }
+                auto n = *reading++;
+                if (*reading == ',' && digit(*(reading + 1)))
+                {
+                    reading += 2;
+                    if (*(reading - 1) < n)
+                    {
+                        return error("bad quantifier", at);
+                    }
+                }
+                else if (*reading == ',')
+                {
+                    ++reading;
+                }
+                if (*reading != '}')
+                {
+                    return error("bad quantifier", at);
+                }
+                break;
+            }
+            default:
+                operand = true;
+                break;
+            }
+        }
+
+        if (!opened.empty())
+        {
+            return error("unbalanced (", opened.back());
+        }
+        return std::string();
+    }
+
+    // alternations of plain literals skip the NFA/DFA pipeline, which cannot cope with thousands of branches
+    std::tuple<std::shared_ptr<AhoCorasick>, bool, bool>
+    gen_literals(const char32_t *reading)
+    {
+        std::vector<std::u32string> words(1);
+
+        if (*reading == '^')
+        {
+            ++reading;
+            begin = true;
+        }
+
+        for (; *reading; ++reading)
+        {
+            switch (*reading)
+            {
+            case '|':
+                if (words.back().empty())
+                {
+                    return std::make_tuple(nullptr, false, false);
+                }
+                words.emplace_back();
+                break;
+            case '$':
+                if (*(reading + 1))
+                {
+                    return std::make_tuple(nullptr, false, false);
+                }
+                end = true;
+                break;
+            case '\\':
+                if (!*(reading + 1) || ECMAP.count(*(reading + 1)))
+                {
+                    return std::make_tuple(nullptr, false, false);
+                }
+                words.back() += translate_escape_chr(reading);
+                break;
+            case '^': case '.': case '*': case '+': case '?':
+            case '(': case ')': case '[': case ']': case '{': case '}':
+                return std::make_tuple(nullptr, false, false);
+            default:
+                words.back() += *reading;
+                break;
+            }
+        }
+
+        if (words.size() < 2 || words.back().empty())
+        {
+            return std::make_tuple(nullptr, false, false);
+        }
+        return std::make_tuple(std::make_shared<AhoCorasick>(words), begin, end);
+    }
+
+    // simplify = false compiles the tree as parsed, for checking simplify() against it,
+    // stats, if given, gets every phase up to the minimized DFA
+    std::tuple<std::shared_ptr<DFAState>, bool, bool>
+    gen_dfa(const char32_t *reading, bool simplify = true, CompileStats *stats = nullptr)
+    {
+        Stopwatch watch;
+        auto node = root = gen_node(reading);
+        if (!node)
+        {
+            return std::make_tuple(std::make_shared<DFAState>(DFAState::State::END), begin, end);
+        }
+
+        if (!stats)
+        {
+            return std::make_tuple((simplify ? node->simplify() : node)->compile()->to_dfa(), begin, end);
+        }
+
+        stats->parse = watch.lap();
+        if (simplify)
+        {
+            node = node->simplify();
+        }
+        stats->simplify = watch.lap();
+        auto nfa = node->compile();
+        stats->thompson = watch.lap();
+        return std::make_tuple(nfa->to_dfa(stats), begin, end);
+    }
+
+    // NFA of the simplified expression, one accepting only the empty string if the expression is empty
+    std::tuple<std::shared_ptr<NFAPair>, bool, bool>
+    gen_nfa(const char32_t *reading)
+    {
+        auto node = root = gen_node(reading);
+        std::shared_ptr<NFAPair> nfa;
+        if (node)
+        {
+            nfa = node->simplify()->compile();
+        }
+        else
+        {
+            nfa = std::make_shared<NFAPair>();
+            nfa->start->edge_type = NFAState::EdgeType::EPSILON;
+            nfa->start->next = nfa->end;
+        }
+        return std::make_tuple(nfa, begin, end);
+    }
+
+    // the longest literal every match of the expression gen_dfa parsed last contains
+    std::u32string
+    gen_required()
+    {
+        return root ? root->literals().inner : std::u32string();
+    }
+
+    // bounds of the byte length of every match of the expression gen_dfa parsed last
+    Lengths
+    gen_lengths()
+    {
+        return root ? root->lengths() : Lengths();
+    }
+
+    // groups of the expression gen_dfa parsed last, nullptr if it has none
+    std::shared_ptr<GroupLocator>
+    gen_locator()
+    {
+        return groups ? std::make_shared<GroupLocator>(root, groups, group_names) : nullptr;
+    }
+};
+} // namespace details
+
+// bytes held by a compiled Pattern, which its copies share
+struct MemoryUsage
+{
+    // transition table, accepting flags and self loops of the DFA
+    std::size_t automaton = 0;
+    std::size_t jit = 0;
+    // Aho-Corasick automaton of an alternation of literals
+    std::size_t literals = 0;
+    // required literal of the search prefilter
+    std::size_t prefilter = 0;
+    // syntax tree kept for capture groups
+    std::size_t captures = 0;
+
+    std::size_t
+    total() const
+    {
+        return automaton + jit + literals + prefilter + captures;
+    }
+};
+
+// what Pattern::optimize_layout achieved
+struct LayoutReport
+{
+    std::size_t states = 0;
+    // states whose rows fit in kCacheBytes at the front of the transition table, behind the dead state's row
+    std::size_t hot_states = 0;
+    // share of the profiled visits which hit the hot states, before and after renumbering
+    double coverage_before = 0;
+    double coverage = 0;
+
+    static constexpr std::size_t kCacheBytes = 32 * 1024;
+};
+
+class AsyncPattern;
+
+// runs task(0) ... task(n - 1), possibly in parallel, and returns once all of them are done
+using Executor = std::function<void(std::size_t n, const std::function<void(std::size_t)> &task)>;
+
+// an Executor on threads of its own, each taking the next task as soon as it is done with one, so a few
+// slow tasks do not hold up the others
+inline Executor
+thread_executor(std::size_t threads = std::thread::hardware_concurrency())
+{
+    return [threads](std::size_t n, const std::function<void(std::size_t)> &task)
+    {
+        std::atomic<std::size_t> next(0);
+        auto work = [&]()
+        {
+            for (std::size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+            {
+                task(i);
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (std::size_t k = 1; k < std::min(std::max<std::size_t>(threads, 1), n); ++k)
+        {
+            pool.emplace_back(work);
+        }
+        work();
+        for (auto &thread : pool)
+        {
+            thread.join();
+        }
+    };
+}
+
+class Pattern
+{
+  private:
+    static constexpr std::size_t kShardSize = 4096;
+    static constexpr std::size_t kPrefetchDistance = 8;
+    static constexpr std::size_t kLanes = 8;
+    // group index of unknown references in a replace format, they are replaced by nothing
+    static constexpr std::size_t kNoGroup = std::string_view::npos - 1;
+
+    std::shared_ptr<details::DFATable> table;
+    // the transitions of table with 8 or 16 bit states, at most one of them when table is small enough
+    std::shared_ptr<details::NarrowTable<std::uint8_t>> table8;
+    std::shared_ptr<details::NarrowTable<std::uint16_t>> table16;
+    std::shared_ptr<details::DFAJit> jit;
+    std::shared_ptr<details::AhoCorasick> literals;
+    std::shared_ptr<details::RequiredLiteral> required;
+    std::shared_ptr<details::GroupLocator> locator;
+    std::shared_ptr<const CompileStats> stats;
+#if defined(YARE_TELEMETRY)
+    std::shared_ptr<details::Telemetry> telemetry = std::make_shared<details::Telemetry>();
+#endif
+    details::Lengths lengths;
+    bool begin, end;
+    // the pattern, only kept when it is matched without a DFA, to build one for the automaton algebra
+    std::string source;
+
+    // where calls are recorded, nullptr when telemetry is compiled out
+    details::Telemetry *
+    counters() const
+    {
+#if defined(YARE_TELEMETRY)
+        return telemetry.get();
+#else
+        return nullptr;
+#endif
+    }
+
+    // byte length of the longest accepted prefix of str, npos if there is none
+    std::size_t
+    match_prefix(std::string_view str) const
+    {
+        return str.size() < lengths.min ? std::string_view::npos
+             : literals ? literals->match(str, end)
+             : jit ? jit->match(str, end)
+             : table8 ? table8->match(str, end)
+             : table16 ? table16->match(str, end)
+             : table->match(str, end);
+    }
+
+    // a Pattern matching with table, anchored by begin and end
+    Pattern(std::shared_ptr<details::DFATable> table, bool begin, bool end)
+      : table(table), lengths(details::lengths_of(*table)), begin(begin), end(end)
+    {
+        narrow();
+    }
+
+    // the DFA of the pattern, built from source for one matched without a DFA
+    std::shared_ptr<const details::DFATable>
+    automaton() const
+    {
+        if (table)
+        {
+            return table;
+        }
+        auto str = details::str_to_utf8(source);
+        auto dfa = std::get<0>(details::Parse().gen_dfa(str.c_str()));
+        auto res = std::make_shared<details::DFATable>(dfa);
+        details::release(dfa);
+        return res;
+    }
+
+    // the result is anchored where either pattern is, so an operand without an anchor the other has is read
+    // with any text on that side of it, as if .* stood there
+    Pattern
+    combine(const Pattern &other, details::Combine op) const
+    {
+        auto begins = begin || other.begin, ends = end || other.end;
+        auto operand = [begins, ends](const Pattern &pattern)
+        {
+            auto dfa = pattern.automaton();
+            if (begins == pattern.begin && ends == pattern.end)
+            {
+                return dfa;
+            }
+            auto wide = details::widen(*dfa, begins && !pattern.begin, ends && !pattern.end);
+            return std::shared_ptr<const details::DFATable>(wide);
+        };
+        return Pattern(details::product(*operand(*this), *operand(other), op), begins, ends);
+    }
+
+    // picks the narrowest state numbers table fits in
+    void
+    narrow()
+    {
+        table8.reset();
+        table16.reset();
+        if (details::NarrowTable<std::uint8_t>::fits(*table))
+        {
+            table8 = std::make_shared<details::NarrowTable<std::uint8_t>>(table);
+        }
+        else if (details::NarrowTable<std::uint16_t>::fits(*table))
+        {
+            table16 = std::make_shared<details::NarrowTable<std::uint16_t>>(table);
+        }
+    }
+
+    void
+    match_range(const std::string_view *strs, std::size_t count, std::size_t *lengths) const
+    {
+        if (table && !jit)
+        {
+            table->match_lanes<kLanes>(strs, count, end, lengths);
+        }
+        else
+        {
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                if (i + kPrefetchDistance < count)
+                {
+                    details::prefetch(strs[i + kPrefetchDistance].data());
+                }
+                lengths[i] = match_prefix(strs[i]);
+            }
+        }
+
+#if defined(YARE_TELEMETRY)
+        std::size_t bytes = 0, matches = 0;
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            bytes += strs[i].size();
+            matches += lengths[i] != std::string_view::npos;
+        }
+        details::record_scan(counters(), bytes, matches);
+#endif
+    }
+
+    // leftmost non-empty match at or after from as (position, length), position is npos if there is none
+    std::pair<std::size_t, std::size_t>
+    find(std::string_view str, std::size_t from) const
+    {
+        auto found = scan(str, from);
+        auto stop = found.first == std::string_view::npos ? str.size() : found.first + found.second;
+        details::record_scan(counters(), stop - std::min(from, stop), found.first != std::string_view::npos);
+        return found;
+    }
+
+    // visits, if given, counts the bytes read in each DFA state as DFATable::search does
+    std::pair<std::size_t, std::size_t>
+    scan(std::string_view str, std::size_t from, std::vector<std::uint64_t> *visits = nullptr) const
+    {
+        // a found match is never empty, so it needs at least one byte
+        auto shortest = std::max<std::size_t>(lengths.min, 1);
+        if ((begin && from) || from > str.size() || str.size() - from < shortest)
+        {
+            return { std::string_view::npos, 0 };
+        }
+        if (literals && !begin)
+        {
+            return literals->search(str, from, end);
+        }
+        if (begin && !visits)
+        {
+            auto len = match_prefix(str);
+            return len && len != std::string_view::npos ? std::make_pair(std::size_t(0), len)
+                                                        : std::make_pair(std::string_view::npos, std::size_t(0));
+        }
+
+        // the DFA runs once over str for all starts, which are only tried where a match could begin: not
+        // after the next occurrence of the required literal, nor too far before it
+        auto hit = std::string_view::npos;
+        auto step = [&](std::size_t pos) { return pos + std::max<std::size_t>(1, details::utf8_length(str[pos])); };
+        auto spawn = [&](std::size_t pos)
+        {
+            for (;;)
+            {
+                if ((begin && pos) || pos + shortest > str.size())
+                {
+                    return std::make_pair(std::string_view::npos, std::string_view::npos);
+                }
+                auto hi = begin ? 0 : str.size() - shortest;
+                if (required && !begin)
+                {
+                    if (hit == std::string_view::npos || hit < pos)
+                    {
+                        hit = required->find(str, pos);
+                        details::record_prefilter(counters(), hit != std::string_view::npos);
+                        if (hit == std::string_view::npos)
+                        {
+                            return std::make_pair(std::string_view::npos, std::string_view::npos);
+                        }
+                    }
+
+                    // a match is at most lengths.max long, so it cannot start too far before the hit
+                    if (lengths.max != details::Lengths::kUnbounded && hit + required->size() > pos + lengths.max)
+                    {
+                        auto lowest = hit + required->size() - lengths.max;
+                        while (pos < lowest)
+                        {
+                            pos = step(pos);
+                        }
+                    }
+                    hi = std::min(hi, hit);
+                }
+                if (pos <= hi)
+                {
+                    return std::make_pair(pos, hi);
+                }
+            }
+        };
+
+        auto found = table->search(str, from, end, spawn, visits);
+        return { found.pos, found.len };
+    }
+
+    // copies the text between matches and lets replacer(out, position, length) write each match
+    template <typename OutputIt, typename Replacer>
+    OutputIt
+    replace_each(OutputIt out, std::string_view str, const Replacer &replacer) const
+    {
+        details::Probe probe(counters());
+        std::size_t copied = 0;
+        for (auto found = find(str, 0); found.first != std::string_view::npos;
+             found = find(str, found.first + found.second))
+        {
+            out = std::copy(str.begin() + copied, str.begin() + found.first, out);
+            out = replacer(out, found.first, found.second);
+            copied = found.first + found.second;
+        }
+        return std::copy(str.begin() + copied, str.end(), out);
+    }
+
+    // splits format into literal runs and group references, a piece is literal if its group is npos
+    std::vector<std::pair<std::string_view, std::size_t>>
+    parse_format(std::string_view format) const
+    {
+        std::vector<std::pair<std::string_view, std::size_t>> pieces;
+        std::size_t copied = 0;
+
+        auto group_of = [&](std::string_view ref)
+        {
+            if (!ref.empty() && std::all_of(ref.begin(), ref.end(), [](unsigned char c) { return std::isdigit(c); }))
+            {
+                // a number too large for size_t cannot name a group either
+                std::size_t group = 0;
+                for (unsigned char c : ref)
+                {
+                    if (group > (kNoGroup - (c - '0')) / 10)
+                    {
+                        return kNoGroup;
+                    }
+                    group = group * 10 + (c - '0');
+                }
+                return group;
+            }
+            if (locator)
+            {
+                auto it = locator->names.find(std::string(ref));
+                if (it != locator->names.end())
+                {
+                    return it->second;
+                }
+            }
+            return kNoGroup;
+        };
+
+        for (std::size_t i = 0; i + 1 < format.size(); ++i)
+        {
+            if (format[i] != '$')
+            {
+                continue;
+            }
+
+            std::size_t group, next = i + 2;
+            if (format[i + 1] == '$')
+            {
+                pieces.push_back({ format.substr(copied, i + 1 - copied), std::string_view::npos });
+                copied = next;
+                ++i;
+                continue;
+            }
+            else if (format[i + 1] == '&')
+            {
+                group = 0;
+            }
+            else if (std::isdigit(static_cast<unsigned char>(format[i + 1])))
+            {
+                while (next < format.size() && std::isdigit(static_cast<unsigned char>(format[next])))
+                {
+                    ++next;
+                }
+                group = group_of(format.substr(i + 1, next - i - 1));
+            }
+            else if (format[i + 1] == '{' && format.find('}', i + 2) != std::string_view::npos)
+            {
+                next = format.find('}', i + 2) + 1;
+                group = group_of(format.substr(i + 2, next - i - 3));
+            }
+            else
+            {
+                continue;
+            }
+
+            pieces.push_back({ format.substr(copied, i - copied), std::string_view::npos });
+            pieces.push_back({ std::string_view(), group });
+            copied = next;
+            i = next - 1;
+        }
+        pieces.push_back({ format.substr(copied), std::string_view::npos });
+
+        return pieces;
+    }
+
+    // shards are multiples of 64 inputs, so no two of them share a bitmap word
+    template <typename Function>
+    static void
+    for_shards(std::size_t count, const Executor &executor, const Function &function)
+    {
+        if (!executor || count <= kShardSize)
+        {
+            function(0, count);
+            return;
+        }
+
+        executor((count + kShardSize - 1) / kShardSize, [&](std::size_t shard)
+        {
+            function(shard * kShardSize, std::min(count, (shard + 1) * kShardSize));
+        });
+    }
+
+  public:
+    // walks the non-empty matches of a string from left to right, computing each one only when asked for
+    class FindIterator
+    {
+      public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = const std::string_view &;
+
+        FindIterator() : pattern(nullptr) {}
+        FindIterator(const Pattern *pattern, std::string_view str) : pattern(pattern), str(str)
+        {
+            advance(0);
+        }
+
+        reference operator*() const { return current; }
+        pointer operator->() const { return &current; }
+
+        FindIterator &
+        operator++()
+        {
+            advance(current.data() - str.data() + current.size());
+            return *this;
+        }
+
+        FindIterator
+        operator++(int)
+        {
+            auto old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool
+        operator==(const FindIterator &other) const
+        {
+            return pattern == other.pattern && (!pattern || current.data() == other.current.data());
+        }
+
+        bool
+        operator!=(const FindIterator &other) const
+        {
+            return !(*this == other);
+        }
+
+      private:
+        // nullptr once there are no more matches
+        const Pattern *pattern;
+        std::string_view str, current;
+
+        void
+        advance(std::size_t from)
+        {
+            auto found = pattern->find(str, from);
+            if (found.first == std::string_view::npos)
+            {
+                pattern = nullptr;
+            }
+            else
+            {
+                current = str.substr(found.first, found.second);
+            }
+        }
+    };
+
+    class FindRange
+    {
+      private:
+        const Pattern *pattern;
+        std::string_view str;
+
+      public:
+        FindRange(const Pattern *pattern, std::string_view str) : pattern(pattern), str(str) {}
+
+        FindIterator begin() const { return FindIterator(pattern, str); }
+        FindIterator end() const { return FindIterator(); }
+    };
+
+    class SplitIterator
+    {
+      public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const std::string_view *;
+        using reference = const std::string_view &;
+
+        SplitIterator() : pattern(nullptr) {}
+        SplitIterator(const Pattern *pattern, std::string_view str, std::size_t limit)
+          : pattern(limit ? pattern : nullptr), str(str), limit(limit)
+        {
+            advance();
+        }
+
+        reference operator*() const { return current; }
+        pointer operator->() const { return &current; }
+
+        SplitIterator &
+        operator++()
+        {
+            advance();
+            return *this;
+        }
+
+        SplitIterator
+        operator++(int)
+        {
+            auto old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool
+        operator==(const SplitIterator &other) const
+        {
+            return pattern == other.pattern && (!pattern || next == other.next);
+        }
+
+        bool
+        operator!=(const SplitIterator &other) const
+        {
+            return !(*this == other);
+        }
+
+      private:
+        // nullptr once every field is produced
+        const Pattern *pattern;
+        std::string_view str, current;
+        // start of the next field, npos after the last one
+        std::size_t next = 0, limit = 0;
+
+        void
+        advance()
+        {
+            if (!pattern)
+            {
+                return;
+            }
+            if (next == std::string_view::npos)
+            {
+                pattern = nullptr;
+                return;
+            }
+
+            // the last allowed field is the rest of str, delimiters and all
+            auto found = --limit ? pattern->find(str, next) : std::make_pair(std::string_view::npos, std::size_t(0));
+            if (found.first == std::string_view::npos)
+            {
+                current = str.substr(next);
+                next = std::string_view::npos;
+            }
+            else
+            {
+                current = str.substr(next, found.first - next);
+                next = found.first + found.second;
+            }
+        }
+    };
+
+    class SplitRange
+    {
+      private:
+        const Pattern *pattern;
+        std::string_view str;
+        std::size_t limit;
+
+      public:
+        SplitRange(const Pattern *pattern, std::string_view str, std::size_t limit)
+          : pattern(pattern), str(str), limit(limit) {}
+
+        SplitIterator begin() const { return SplitIterator(pattern, str, limit); }
+        SplitIterator end() const { return SplitIterator(); }
+    };
+
+    Pattern(const std::string &pattern) : Pattern(pattern, false) {}
+
+    // a handle which matches at once, by NFA simulation until the Pattern is compiled by a shared pool of
+    // background threads
+    static AsyncPattern
+    compile_async(const std::string &pattern);
+
+    // profile = true keeps the CompileStats of the compilation, for compile_stats()
+    Pattern(const std::string &pattern, bool profile)
+    {
+        CompileStats collected;
+        auto profiled = profile ? &collected : nullptr;
+        details::Stopwatch watch;
+
+        auto str = details::str_to_utf8(pattern);
+        std::tie(literals, begin, end) = details::Parse().gen_literals(str.c_str());
+        if (literals)
+        {
+            lengths = literals->lengths();
+            source = pattern;
+            collected.parse = watch.lap();
+        }
+        else
+        {
+            details::Parse parse;
+            details::DFAPtr dfa;
+            std::tie(dfa, begin, end) = parse.gen_dfa(str.c_str(), true, profiled);
+            // gen_literals gave up on the pattern, which counts as parsing
+            collected.parse += watch.lap() - collected.total();
+            table = std::make_shared<details::DFATable>(dfa);
+            details::release(dfa);
+            narrow();
+            collected.classes = table->classes;
+            locator = parse.gen_locator();
+            lengths = parse.gen_lengths();
+
+            auto literal = parse.gen_required();
+            if (!literal.empty())
+            {
+                required = std::make_shared<details::RequiredLiteral>(details::utf8_to_str(literal));
+            }
+            collected.table = watch.lap();
+        }
+
+        if (profile)
+        {
+            collected.patterns = 1;
+            stats = std::make_shared<CompileStats>(collected);
+        }
+    }
+
+    // counters of the calls so far, summed over the copies of this Pattern
+    TelemetrySnapshot
+    telemetry_snapshot() const
+    {
+#if defined(YARE_TELEMETRY)
+        return telemetry->snapshot();
+#else
+        return TelemetrySnapshot();
+#endif
+    }
+
+    // nullptr unless the pattern was compiled with profile = true
+    const CompileStats *
+    compile_stats() const
+    {
+        return stats.get();
+    }
+
+    MemoryUsage
+    memory_usage() const
+    {
+        MemoryUsage usage;
+        usage.automaton = (table ? table->memory_usage() : 0) + (table8 ? table8->memory_usage() : 0)
+            + (table16 ? table16->memory_usage() : 0);
+        usage.jit = jit ? jit->memory_usage() : 0;
+        usage.literals = literals ? literals->memory_usage() : 0;
+        usage.prefilter = required ? required->memory_usage() : 0;
+        usage.captures = locator ? locator->memory_usage() : 0;
+        return usage;
+    }
+
+    // the strings both patterns accept; like unite and subtract, the result is anchored where either pattern
+    // is, and a pattern without '^' or '$' the other has counts as having .* there, so "^a" and "b" combine
+    // like "^a" and "^.*b"
+    Pattern
+    intersect(const Pattern &other) const
+    {
+        return combine(other, details::Combine::INTERSECT);
+    }
+
+    // the strings either pattern accepts
+    Pattern
+    unite(const Pattern &other) const
+    {
+        return combine(other, details::Combine::UNITE);
+    }
+
+    // the strings this pattern accepts and other does not
+    Pattern
+    subtract(const Pattern &other) const
+    {
+        return combine(other, details::Combine::SUBTRACT);
+    }
+
+    // whether the pattern accepts no string at all, so nothing ever matches
+    bool
+    is_empty() const
+    {
+        auto dfa = automaton();
+        return std::find(dfa->accept.begin() + 1, dfa->accept.end(), true) == dfa->accept.end();
+    }
+
+    // whether every string other accepts is accepted by this pattern too, with the anchors read as in intersect,
+    // so "ab" includes "ab$" but "ab$" does not include "ab"
+    bool
+    includes(const Pattern &other) const
+    {
+        return other.subtract(*this).is_empty();
+    }
+
+    // bytes per state number in the transitions matching walks, 0 for a pattern matched without a DFA; it
+    // stays the same after enable_jit(), although the native code then matches instead of the narrow table,
+    // and a narrow table is a copy kept next to the 4 byte one, so it adds to memory_usage()
+    std::size_t
+    state_width() const
+    {
+        return table8 ? 1 : table16 ? 2 : table ? 4 : 0;
+    }
+
+    // byte length of the shortest match
+    std::size_t
+    min_length() const
+    {
+        return lengths.min;
+    }
+
+    // byte length of the longest match, npos if matches can be arbitrarily long
+    std::size_t
+    max_length() const
+    {
+        return lengths.max;
+    }
+
+    // whether the empty string is accepted, search and replace still skip empty matches
+    bool
+    matches_empty() const
+    {
+        return lengths.min == 0;
+    }
+
+    // whether matches can only start at the beginning of the input
+    bool
+    anchored() const
+    {
+        return begin;
+    }
+
+    // compiles the DFA to native code where that is supported, returns whether matching now uses it
+    bool
+    enable_jit()
+    {
+        if (table && !jit)
+        {
+            auto compiled = std::make_shared<details::DFAJit>(table);
+            if (compiled->ready())
+            {
+                jit = compiled;
+            }
+        }
+        return jit != nullptr;
+    }
+
+    // visits[state] counts the bytes read in each state of the DFA by searching strs, empty for a pattern
+    // matched without a DFA
+    std::vector<std::uint64_t>
+    profile_states(const std::string_view *strs, std::size_t count) const
+    {
+        std::vector<std::uint64_t> visits(table ? table->states() : 0, 0);
+        for (std::size_t i = 0; table && i < count; ++i)
+        {
+            for (auto found = scan(strs[i], 0, &visits); found.first != std::string_view::npos;
+                 found = scan(strs[i], found.first + found.second, &visits)) {}
+        }
+        return visits;
+    }
+
+    // renumbers the DFA states by how often visits says they are used, so the hottest rows of the transition
+    // table are next to each other at its front; copies made before keep the old table
+    LayoutReport
+    optimize_layout(const std::vector<std::uint64_t> &visits)
+    {
+        LayoutReport report;
+        if (!table || visits.size() != table->states())
+        {
+            return report;
+        }
+
+        // the dead row stays first and takes one of the rows that fit
+        report.states = table->states() - 1;
+        auto rows = LayoutReport::kCacheBytes / (table->classes * sizeof(std::uint32_t));
+        report.hot_states = std::min(report.states, rows ? rows - 1 : 0);
+
+        std::vector<std::uint32_t> order(table->states());
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin() + 1, order.end(), [&visits](std::uint32_t a, std::uint32_t b)
+        {
+            return visits[a] > visits[b];
+        });
+
+        auto total = std::accumulate(visits.begin() + 1, visits.end(), std::uint64_t(0));
+        auto hot = [&](const std::uint32_t *numbers)
+        {
+            std::uint64_t sum = 0;
+            for (std::size_t k = 1; k <= report.hot_states; ++k)
+            {
+                sum += visits[numbers[k]];
+            }
+            return total ? static_cast<double>(sum) / total : 1.0;
+        };
+        std::vector<std::uint32_t> identity(table->states());
+        std::iota(identity.begin(), identity.end(), 0);
+        report.coverage_before = hot(identity.data());
+        report.coverage = hot(order.data());
+
+        auto renumbered = std::make_shared<details::DFATable>(*table);
+        renumbered->renumber(order);
+        table = renumbered;
+        narrow();
+        return report;
+    }
+
+    LayoutReport
+    optimize_layout(const std::string_view *strs, std::size_t count)
+    {
+        return optimize_layout(profile_states(strs, count));
+    }
+
+    // the matches of str as string_views into it, both str and the pattern have to outlive the range
+    FindRange
+    find_iter(std::string_view str) const
+    {
+        return FindRange(this, str);
+    }
+
+    // the fields of str between the matches as string_views into it, found one at a time as the iterator
+    // advances; there is always one more field than matches, so an empty str is one empty field
+    SplitRange
+    split(std::string_view str) const
+    {
+        return SplitRange(this, str, std::string_view::npos);
+    }
+
+    // like split but at most limit fields, the last of them is the rest of str
+    SplitRange
+    splitn(std::string_view str, std::size_t limit) const
+    {
+        return SplitRange(this, str, limit);
+    }
+
+    // number of matches find_iter would produce, without materializing any of them
+    std::size_t
+    count(std::string_view str) const
+    {
+        details::Probe probe(counters());
+        std::size_t res = 0;
+        for (auto found = find(str, 0); found.first != std::string_view::npos;
+             found = find(str, found.first + found.second))
+        {
+            ++res;
+        }
+        return res;
+    }
+
+    // writes str to out with every match replaced by format, in which $& and $0 stand for the whole match,
+    // $n and ${n} for the n-th group, ${name} for a named group and $$ for '$'
+    template <typename OutputIt>
+    OutputIt
+    replace_to(OutputIt out, std::string_view str, std::string_view format) const
+    {
+        auto pieces = parse_format(format);
+        bool grouped = std::any_of(pieces.begin(), pieces.end(), [](const std::pair<std::string_view, std::size_t> &piece)
+        {
+            return piece.second != std::string_view::npos && piece.second != 0;
+        });
+
+        std::vector<std::pair<std::size_t, std::size_t>> groups;
+        return replace_each(out, str, [&](OutputIt out, std::size_t pos, std::size_t len)
+        {
+            if (grouped && locator)
+            {
+                groups = locator->locate(str, pos, len);
+            }
+            for (const auto &piece : pieces)
+            {
+                std::string_view text = piece.first;
+                if (piece.second == 0)
+                {
+                    text = str.substr(pos, len);
+                }
+                else if (piece.second < groups.size() && groups[piece.second].first != std::string_view::npos)
+                {
+                    text = str.substr(groups[piece.second].first, groups[piece.second].second);
+                }
+                out = std::copy(text.begin(), text.end(), out);
+            }
+            return out;
+        });
+    }
+
+    // writes str to out with every match replaced by callback(match), which returns something a
+    // std::string_view can be made of
+    template <typename OutputIt, typename Callback>
+    OutputIt
+    replace_with(OutputIt out, std::string_view str, Callback callback) const
+    {
+        return replace_each(out, str, [&](OutputIt out, std::size_t pos, std::size_t len)
+        {
+            const auto &res = callback(str.substr(pos, len));
+            std::string_view text(res);
+            return std::copy(text.begin(), text.end(), out);
+        });
+    }
+
+    // lengths[i] is the byte length of match(strs[i]), or npos if strs[i] does not match
+    void
+    match_batch(const std::string_view *strs, std::size_t count, std::size_t *lengths,
+        const Executor &executor = nullptr) const
+    {
+        details::Probe probe(counters());
+        for_shards(count, executor, [&](std::size_t first, std::size_t last)
+        {
+            match_range(strs + first, last - first, lengths + first);
+        });
+    }
+
+    // bit i % 64 of bitmap[i / 64] is set if strs[i] matches
+    void
+    match_bitmap(const std::string_view *strs, std::size_t count, std::uint64_t *bitmap,
+        const Executor &executor = nullptr) const
+    {
+        details::Probe probe(counters());
+        for_shards(count, executor, [&](std::size_t first, std::size_t last)
+        {
+            std::size_t lengths[64];
+            for (auto i = first; i < last; i += 64)
+            {
+                auto size = std::min<std::size_t>(64, last - i);
+                match_range(strs + i, size, lengths);
+
+                std::uint64_t word = 0;
+                for (std::size_t j = 0; j < size; ++j)
+                {
+                    if (lengths[j] != std::string_view::npos)
+                    {
+                        word |= std::uint64_t(1) << j;
+                    }
+                }
+                bitmap[i / 64] = word;
+            }
+        });
+    }
+
+    std::u32string
+    match(const std::u32string &str)
+    {
+        if (literals)
+        {
+            return str.substr(0, literals->match(str.c_str(), end));
+        }
+
+        return str.substr(0, table->match(str.c_str(), end));
+    }
+
+    // the same as the byte versions, on str turned into bytes
+    std::u32string
+    search(const std::u32string &str)
+    {
+        return details::str_to_utf8(search(details::utf8_to_str(str)));
+    }
+
+    std::u32string
+    replace(const std::u32string &str, const std::u32string &target)
+    {
+        return details::str_to_utf8(replace(details::utf8_to_str(str), details::utf8_to_str(target)));
+    }
+
+    std::string
+    match(const std::string &str)
+    {
+        details::Probe probe(counters());
+        auto len = match_prefix(str);
+        details::record_scan(counters(), str.size(), len != std::string::npos);
+        return len == std::string::npos ? std::string() : str.substr(0, len);
+    }
+
+    std::string
+    search(const std::string &str)
+    {
+        if (begin)
+        {
+            return match(str);
+        }
+
+        details::Probe probe(counters());
+        auto found = find(str, 0);
+        return found.first == std::string::npos
+            ? std::string()
+            : str.substr(found.first, found.second);
+    }
+
+    std::string
+    replace(const std::string &str, const std::string &target)
+    {
+        if (begin)
+        {
+            details::Probe probe(counters());
+            auto len = match_prefix(str);
+            details::record_scan(counters(), str.size(), len != std::string::npos);
+            return target + str.substr(len == std::string::npos ? 0 : len);
+        }
+
+        std::string res;
+        replace_with(std::back_inserter(res), str, [&](std::string_view)
+        {
+            return std::string_view(target);
+        });
+        return res;
+    }
+
+    std::vector<std::string>
+    matches(const std::string &str)
+    {
+        if (begin)
+        {
+            return {match(str)};
+        }
+
+        details::Probe probe(counters());
+        std::vector<std::string> res;
+        for (auto found : find_iter(str))
+        {
+            res.emplace_back(found);
+        }
+
+        return res;
+    }
+};
+
+// a Pattern being compiled on a background thread: until it is ready, matches are found by simulating the
+// NFA, then the compiled Pattern is swapped in atomically; copies share the Pattern. The background thread
+// compiles from the source and so parses it again, which is little next to building the DFA
+class AsyncPattern
+{
+  private:
+    // one thread per core compiling the patterns in the order they were asked for; the threads are joined
+    // when the program exits, after the Patterns they are compiling, and what is still queued is dropped
+    class Queue
+    {
+      private:
+        std::mutex mutex;
+        std::condition_variable pending;
+        std::list<std::function<void()>> tasks;
+        std::vector<std::thread> threads;
+        bool stopping = false;
+
+        void
+        work()
+        {
+            for (;;)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                pending.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (stopping)
+                {
+                    return;
+                }
+                auto task = std::move(tasks.front());
+                tasks.pop_front();
+                lock.unlock();
+                task();
+            }
+        }
+
+        Queue()
+        {
+            for (std::size_t i = 0; i < std::max(1U, std::thread::hardware_concurrency()); ++i)
+            {
+                threads.emplace_back(&Queue::work, this);
+            }
+        }
+
+      public:
+        ~Queue()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            pending.notify_all();
+            for (auto &thread : threads)
+            {
+                thread.join();
+            }
+        }
+
+        static Queue &
+        instance()
+        {
+            static Queue queue;
+            return queue;
+        }
+
+        void
+        push(std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back(std::move(task));
+            }
+            pending.notify_one();
+        }
+    };
+
+    struct Shared
+    {
+        std::shared_ptr<const details::NFASimulator> simulator;
+        bool begin, end;
+        std::shared_ptr<Pattern> compiled;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+    std::shared_ptr<Shared> shared;
+
+    std::shared_ptr<Pattern>
+    loaded() const
+    {
+        return std::atomic_load_explicit(&shared->compiled, std::memory_order_acquire);
+    }
+
+    // leftmost non-empty match at or after from as (position, length) by simulation, like Pattern::find
+    std::pair<std::size_t, std::size_t>
+    find(std::string_view str, std::size_t from) const
+    {
+        return shared->simulator->find(str, from, shared->begin, shared->end);
+    }
+
+  public:
+    AsyncPattern(const std::string &pattern) : shared(std::make_shared<Shared>())
+    {
+        auto str = details::str_to_utf8(pattern);
+        std::shared_ptr<details::NFAPair> nfa;
+        std::tie(nfa, shared->begin, shared->end) = details::Parse().gen_nfa(str.c_str());
+        shared->simulator = std::make_shared<details::NFASimulator>(std::move(nfa));
+
+        Queue::instance().push([shared = shared, pattern]()
+        {
+            auto compiled = std::make_shared<Pattern>(pattern);
+            std::lock_guard<std::mutex> lock(shared->mutex);
+            std::atomic_store_explicit(&shared->compiled, compiled, std::memory_order_release);
+            shared->done.notify_all();
+        });
+    }
+
+    bool
+    ready() const
+    {
+        return loaded() != nullptr;
+    }
+
+    // blocks until the Pattern is compiled and returns it
+    std::shared_ptr<Pattern>
+    wait() const
+    {
+        std::unique_lock<std::mutex> lock(shared->mutex);
+        shared->done.wait(lock, [this]() { return ready(); });
+        return loaded();
+    }
+
+    std::string
+    match(const std::string &str) const
+    {
+        if (auto compiled = loaded())
+        {
+            return compiled->match(str);
+        }
+        auto len = shared->simulator->match(str, shared->end);
+        return len == std::string::npos ? std::string() : str.substr(0, len);
+    }
+
+    std::string
+    search(const std::string &str) const
+    {
+        if (auto compiled = loaded())
+        {
+            return compiled->search(str);
+        }
+        if (shared->begin)
+        {
+            return match(str);
+        }
+        auto found = find(str, 0);
+        return found.first == std::string::npos ? std::string() : str.substr(found.first, found.second);
+    }
+
+    std::string
+    replace(const std::string &str, const std::string &target) const
+    {
+        if (auto compiled = loaded())
+        {
+            return compiled->replace(str, target);
+        }
+        if (shared->begin)
+        {
+            auto len = shared->simulator->match(str, shared->end);
+            return target + str.substr(len == std::string::npos ? 0 : len);
+        }
+
+        std::string res;
+        std::size_t copied = 0;
+        for (auto found = find(str, 0); found.first != std::string::npos; found = find(str, copied))
+        {
+            res.append(str, copied, found.first - copied).append(target);
+            copied = found.first + found.second;
+        }
+        return res.append(str, copied, std::string::npos);
+    }
+
+    std::vector<std::string>
+    matches(const std::string &str) const
+    {
+        if (auto compiled = loaded())
+        {
+            return compiled->matches(str);
+        }
+        if (shared->begin)
+        {
+            return { match(str) };
+        }
+
+        std::vector<std::string> res;
+        for (auto found = find(str, 0); found.first != std::string::npos; found = find(str, found.first + found.second))
+        {
+            res.push_back(str.substr(found.first, found.second));
+        }
+        return res;
+    }
+};
+
+inline AsyncPattern
+Pattern::compile_async(const std::string &pattern)
+{
+    return AsyncPattern(pattern);
+}
+
+// the outcome of compiling one pattern of compile_all
+struct CompileResult
+{
+    // nullptr if compiling failed, identical pattern strings share one Pattern
+    std::shared_ptr<Pattern> pattern;
+    // why compiling failed: a syntax error Parse::check found, such as an unbalanced group, an unterminated
+    // bracket, a bad {n,m} or a quantifier with nothing to repeat
+    std::string error;
+    // time the compile took, 0 for a duplicate
+    double seconds = 0;
+    // index of the first identical pattern string, npos for that first one
+    std::size_t duplicate_of = std::string::npos;
+};
+
+// compiles patterns[0] ... patterns[count - 1] over executor, every distinct pattern string only once
+inline std::vector<CompileResult>
+compile_all(const std::string *patterns, std::size_t count, const Executor &executor = thread_executor())
+{
+    std::vector<CompileResult> results(count);
+    std::vector<std::size_t> distinct;
+    std::unordered_map<std::string_view, std::size_t> first;
+    for (std::size_t i = 0; i < count; ++i)
+    {
+        auto found = first.emplace(patterns[i], i);
+        if (found.second)
+        {
+            distinct.push_back(i);
+        }
+        else
+        {
+            results[i].duplicate_of = found.first->second;
+        }
+    }
+
+    auto compile = [&](std::size_t k)
+    {
+        auto &result = results[distinct[k]];
+        details::Stopwatch watch;
+        try
+        {
+            result.error = details::Parse::check(details::str_to_utf8(patterns[distinct[k]]).c_str());
+            if (result.error.empty())
+            {
+                result.pattern = std::make_shared<Pattern>(patterns[distinct[k]]);
+            }
+        }
+        catch (const std::exception &e)
+        {
+            result.error = e.what();
+        }
+        result.seconds = watch.lap();
+    };
+    if (executor)
+    {
+        executor(distinct.size(), compile);
+    }
+    else
+    {
+        for (std::size_t k = 0; k < distinct.size(); ++k)
+        {
+            compile(k);
+        }
+    }
+
+    for (auto &result : results)
+    {
+        if (result.duplicate_of != std::string::npos)
+        {
+            result.pattern = results[result.duplicate_of].pattern;
+            result.error = results[result.duplicate_of].error;
+        }
+    }
+    return results;
+}
+
+inline std::vector<CompileResult>
+compile_all(const std::vector<std::string> &patterns, const Executor &executor = thread_executor())
+{
+    return compile_all(patterns.data(), patterns.size(), executor);
+}
+
+// keeps the matches of a pattern in a text which is edited in place, the same matches find_iter produces;
+// the scan records checkpoints, after every match and at least every kInterval bytes without one, with how
+// far the scan up to there has read, so an edit resumes at the last checkpoint it cannot have changed and
+// stops at the first old checkpoint after the edit which the new scan lands on again. The checkpoints are
+// kept in blocks of up to kBlock with one shift for the positions of a whole block, so an edit rewrites the
+// checkpoints it rescans and only moves the shifts of the blocks after it; the text is one string, which
+// moves its tail on every edit
+class IncrementalMatcher
+{
+  public:
+    static constexpr std::size_t kInterval = 4096;
+    static constexpr std::size_t kBlock = 512;
+
+    // (position, length) of a match
+    using Match = std::pair<std::size_t, std::size_t>;
+
+    struct Changes
+    {
+        // the matches which are gone, in the old text, and the new ones, in the edited text
+        std::vector<Match> removed;
+        std::vector<Match> added;
+    };
+
+  private:
+    struct Checkpoint
+    {
+        // where the scan continues, the highest reach of any attempt before, and the length of the match
+        // which ends at cursor, 0 if the scan got there without one
+        std::size_t cursor;
+        std::size_t reach;
+        std::size_t length;
+    };
+
+    struct Block
+    {
+        // added to cursor and reach of every checkpoint of the block
+        std::size_t shift = 0;
+        std::vector<Checkpoint> checkpoints;
+
+        Checkpoint
+        operator[](std::size_t i) const
+        {
+            auto res = checkpoints[i];
+            res.cursor += shift;
+            res.reach += shift;
+            return res;
+        }
+    };
+
+    // a checkpoint as its block and its index there, { blocks.size(), 0 } is past the last one
+    struct Place
+    {
+        std::size_t block;
+        std::size_t index;
+
+        bool
+        operator<(const Place &other) const
+        {
+            return block < other.block || (block == other.block && index < other.index);
+        }
+    };
+
+    std::shared_ptr<details::DFATable> table;
+    bool begin, end;
+    std::string str;
+    std::vector<Block> blocks;
+
+    Place
+    next_of(Place place) const
+    {
+        return ++place.index < blocks[place.block].checkpoints.size() ? place : Place{ place.block + 1, 0 };
+    }
+
+    // the first checkpoint beyond holds for, it holds for every checkpoint after that one too
+    template <typename Beyond>
+    Place
+    locate(const Beyond &beyond) const
+    {
+        std::size_t b = std::partition_point(blocks.begin(), blocks.end(),
+            [&beyond](const Block &block) { return !beyond(block[0]); }) - blocks.begin();
+        if (!b)
+        {
+            return { 0, 0 };
+        }
+        const auto &block = blocks[b - 1];
+        std::size_t low = 0, high = block.checkpoints.size();
+        while (low < high)
+        {
+            auto middle = (low + high) / 2;
+            if (beyond(block[middle]))
+            {
+                high = middle;
+            }
+            else
+            {
+                low = middle + 1;
+            }
+        }
+        return low < block.checkpoints.size() ? Place{ b - 1, low } : Place{ b, 0 };
+    }
+
+    // blocks of between kBlock / 2 and kBlock of checkpoints, fewer only if there are not as many
+    static std::vector<Block>
+    chunk(const std::vector<Checkpoint> &checkpoints)
+    {
+        std::vector<Block> res((checkpoints.size() + kBlock - 1) / kBlock);
+        for (std::size_t k = 0; k < res.size(); ++k)
+        {
+            res[k].checkpoints.assign(checkpoints.begin() + checkpoints.size() * k / res.size(),
+                checkpoints.begin() + checkpoints.size() * (k + 1) / res.size());
+        }
+        return res;
+    }
+
+    // scans str from a checkpoint until its end, or until the scan lands on the cursor of an old checkpoint
+    // at or after from moved by delta, whose place is returned, otherwise the place past the last one; the
+    // checkpoints of the scan go to marks, a last mark is left where the scan landed. Each step is one search
+    // over the starts before the next old checkpoint in a window of at least kInterval bytes which goes on
+    // to where the last search stopped reading, so a byte is read by no more than a few searches
+    Place
+    scan(Checkpoint at, std::vector<Checkpoint> &marks, Place from, std::ptrdiff_t delta) const
+    {
+        auto npos = std::string_view::npos;
+        auto pos = at.cursor, reach = at.reach, ahead = pos;
+
+        while (pos < str.size() && !(begin && pos))
+        {
+            auto landing = npos;
+            for (; from.block < blocks.size(); from = next_of(from))
+            {
+                auto cursor = blocks[from.block][from.index].cursor + delta;
+                if (cursor >= pos)
+                {
+                    landing = cursor;
+                    break;
+                }
+            }
+            if (landing == pos)
+            {
+                if (marks.empty() || marks.back().cursor != pos)
+                {
+                    marks.push_back({ pos, reach, 0 });
+                }
+                return from;
+            }
+
+            // the search steps from character to character, so it goes on at the first start past the
+            // window it is offered, which only lands if it is the old checkpoint
+            auto window = std::min({ std::max(pos + kInterval, ahead), landing, str.size() });
+            auto last = begin ? 0 : window - 1, resume = str.size();
+            auto found = table->search(str, pos, end, [last, npos, &resume](std::size_t start)
+            {
+                if (start > last)
+                {
+                    resume = std::min(resume, start);
+                    return std::make_pair(npos, npos);
+                }
+                return std::make_pair(start, last);
+            });
+            reach = std::max(reach, found.reach);
+            ahead = found.reach;
+            pos = found.pos == npos ? resume : found.pos + found.len;
+            if (found.pos != npos || pos < str.size())
+            {
+                marks.push_back({ pos, reach, found.pos == npos ? 0 : found.len });
+            }
+        }
+        return { blocks.size(), 0 };
+    }
+
+  public:
+    IncrementalMatcher(const std::string &pattern, std::string_view text) : str(text)
+    {
+        auto utf8 = details::str_to_utf8(pattern);
+        details::DFAPtr dfa;
+        std::tie(dfa, begin, end) = details::Parse().gen_dfa(utf8.c_str());
+        table = std::make_shared<details::DFATable>(dfa);
+        details::release(dfa);
+        std::vector<Checkpoint> marks;
+        scan({ 0, 0, 0 }, marks, { 0, 0 }, 0);
+        blocks = chunk(marks);
+    }
+
+    const std::string &
+    text() const
+    {
+        return str;
+    }
+
+    // the matches in order, gathered from the checkpoints they end at
+    std::vector<Match>
+    matches() const
+    {
+        std::vector<Match> res;
+        for (const auto &block : blocks)
+        {
+            for (std::size_t i = 0; i < block.checkpoints.size(); ++i)
+            {
+                auto checkpoint = block[i];
+                if (checkpoint.length)
+                {
+                    res.push_back({ checkpoint.cursor - checkpoint.length, checkpoint.length });
+                }
+            }
+        }
+        return res;
+    }
+
+    // replaces removed bytes at pos with inserted, rescanning only as much of the text as the edit can change
+    Changes
+    edit(std::size_t pos, std::size_t removed, std::string_view inserted)
+    {
+        pos = std::min(pos, str.size());
+        removed = std::min(removed, str.size() - pos);
+        auto delta = static_cast<std::ptrdiff_t>(inserted.size()) - static_cast<std::ptrdiff_t>(removed);
+
+        // checkpoints whose scan never read pos stay, reach only grows along them
+        auto kept = locate([pos](const Checkpoint &checkpoint) { return checkpoint.reach > pos; });
+        Checkpoint at = { 0, 0, 0 };
+        if (kept.index)
+        {
+            at = blocks[kept.block][kept.index - 1];
+        }
+        else if (kept.block)
+        {
+            at = blocks[kept.block - 1][blocks[kept.block - 1].checkpoints.size() - 1];
+        }
+
+        str.replace(pos, removed, inserted.data(), inserted.size());
+
+        // a scan past the edit landing on an old checkpoint repeats the old scan from there, so the old
+        // checkpoints from kept up to the one landed on are replaced by the marks of the scan
+        auto after = locate([pos, removed](const Checkpoint &checkpoint) { return checkpoint.cursor >= pos + removed; });
+        std::vector<Checkpoint> marks;
+        auto stop = scan(at, marks, std::max(after, kept), delta);
+        if (stop.block < blocks.size())
+        {
+            stop = next_of(stop);
+        }
+
+        // the rescanned matches which are not the old ones moved by the edit, an old match the edit
+        // overlaps is gone
+        std::vector<Match> old_matches, fresh;
+        for (auto place = kept; place < stop; place = next_of(place))
+        {
+            auto checkpoint = blocks[place.block][place.index];
+            if (checkpoint.length)
+            {
+                old_matches.push_back({ checkpoint.cursor - checkpoint.length, checkpoint.length });
+            }
+        }
+        for (const auto &mark : marks)
+        {
+            if (mark.length)
+            {
+                fresh.push_back({ mark.cursor - mark.length, mark.length });
+            }
+        }
+        Changes changes;
+        auto moved = [&](const Match &match)
+        {
+            return match.first + match.second <= pos ? match
+                 : match.first >= pos + removed ? Match(match.first + delta, match.second)
+                 : Match(std::string_view::npos, 0);
+        };
+        std::size_t i = 0, j = 0;
+        while (i < old_matches.size() || j < fresh.size())
+        {
+            auto old_match = i < old_matches.size() ? moved(old_matches[i]) : Match(std::string_view::npos, 0);
+            if (i < old_matches.size() && j < fresh.size() && old_match == fresh[j])
+            {
+                ++i, ++j;
+            }
+            else if (i < old_matches.size() && (j == fresh.size() || old_match.first == std::string_view::npos
+                || old_match.first <= fresh[j].first))
+            {
+                changes.removed.push_back(old_matches[i++]);
+            }
+            else
+            {
+                changes.added.push_back(fresh[j++]);
+            }
+        }
+
+        // the blocks from kept to stop are built again around the marks, with the blocks after them while
+        // they would be too small; the old checkpoints after the landing only move, but they cannot have
+        // read less than the attempts before the landing now do
+        auto low = kept.block, high = stop.index ? stop.block + 1 : stop.block;
+        std::vector<Checkpoint> rebuilt;
+        for (Place place = { low, 0 }; place < kept; place = next_of(place))
+        {
+            rebuilt.push_back(blocks[place.block][place.index]);
+        }
+        rebuilt.insert(rebuilt.end(), marks.begin(), marks.end());
+        auto reach = rebuilt.empty() ? at.reach : rebuilt.back().reach;
+        auto shifted = [&](Place place)
+        {
+            auto checkpoint = blocks[place.block][place.index];
+            checkpoint.cursor += delta;
+            checkpoint.reach = std::max(reach, checkpoint.reach + delta);
+            reach = checkpoint.reach;
+            return checkpoint;
+        };
+        for (auto place = stop; place.block < high; place = next_of(place))
+        {
+            rebuilt.push_back(shifted(place));
+        }
+        for (; rebuilt.size() < kBlock / 2 && high < blocks.size(); ++high)
+        {
+            for (Place place = { high, 0 }; place.block == high; place = next_of(place))
+            {
+                rebuilt.push_back(shifted(place));
+            }
+        }
+        for (auto k = high; k < blocks.size(); ++k)
+        {
+            blocks[k].shift += delta;
+        }
+        for (auto k = high; k < blocks.size() && blocks[k][0].reach < reach; ++k)
+        {
+            for (auto &checkpoint : blocks[k].checkpoints)
+            {
+                if (checkpoint.reach + blocks[k].shift < reach)
                 {
-                    node = std::make_shared<CatNode>(node, right);
+                    checkpoint.reach = reach - blocks[k].shift;
                 }
-                right = *reading == '\\'
-                    ? translate_echr2node(reading)
-                    : std::make_shared<LeafNode>(*reading);
-                break;
             }
-            ++reading;
         }
+        auto rechunked = chunk(rebuilt);
+        blocks.erase(blocks.begin() + low, blocks.begin() + high);
+        blocks.insert(blocks.begin() + low, rechunked.begin(), rechunked.end());
 
-        if (*reading == '|')
+        return changes;
+    }
+};
+
+// splits text into tokens with one DFA for all token patterns: at every position the longest match of any
+// pattern wins and a tie goes to the pattern listed first, like flex; '^' and '$' are ignored
+class Lexer
+{
+  public:
+    // id of a character which starts no token, it becomes a token of its own
+    static constexpr std::size_t kError = std::string_view::npos;
+
+    struct Token
+    {
+        std::size_t id;
+        std::string_view text;
+    };
+
+    class Iterator
+    {
+      private:
+        const Lexer *lexer = nullptr;
+        std::string_view str;
+        std::size_t pos = 0;
+        Token token = { kError, {} };
+        // the first token at or after pos, the characters before it are kError tokens
+        Token upcoming = { kError, {} };
+        bool searched = false;
+
+        void
+        advance()
         {
-            ++reading;
-            if (right)
+            if (pos == str.size())
             {
-                node = std::make_shared<CatNode>(node, right);
+                lexer = nullptr;
+                return;
             }
-            node = std::make_shared<SelectNode>(node, gen_node(reading));
+            if (!searched)
+            {
+                upcoming = lexer->find(str, pos);
+                searched = true;
+            }
+            if (static_cast<std::size_t>(upcoming.text.data() - str.data()) == pos)
+            {
+                token = upcoming;
+                searched = false;
+            }
+            else
+            {
+                token = skip(str, pos);
+            }
+            pos += token.text.size();
         }
-        else if (right)
+
+      public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = Token;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const Token *;
+        using reference = const Token &;
+
+        Iterator() {}
+        Iterator(const Lexer *lexer, std::string_view str) : lexer(lexer), str(str) { advance(); }
+
+        reference operator*() const { return token; }
+        pointer operator->() const { return &token; }
+
+        Iterator &
+        operator++()
         {
-            node = std::make_shared<CatNode>(node, right);
+            advance();
+            return *this;
         }
 
-        if (*reading == '$')
+        Iterator
+        operator++(int)
         {
-            ++reading;
-            end = true;
+            auto res = *this;
+            advance();
+            return res;
         }
-        return node;
+
+        bool operator==(const Iterator &other) const { return lexer == other.lexer && (!lexer || pos == other.pos); }
+        bool operator!=(const Iterator &other) const { return !(*this == other); }
+    };
+
+    class Range
+    {
+      private:
+        const Lexer *lexer;
+        std::string_view str;
+
+      public:
+        Range(const Lexer *lexer, std::string_view str) : lexer(lexer), str(str) {}
+
+        Iterator begin() const { return Iterator(lexer, str); }
+        Iterator end() const { return Iterator(); }
+    };
+
+  private:
+    std::shared_ptr<details::DFATable> table;
+
+    // the character at pos of str as a kError token, a bad byte is one character
+    static Token
+    skip(std::string_view str, std::size_t pos)
+    {
+        auto size = std::min<std::size_t>(std::max<std::size_t>(1, details::utf8_length(str[pos])), str.size() - pos);
+        return { kError, str.substr(pos, size) };
     }
 
   public:
-    Parse() {}
+    Lexer(const std::vector<std::string> &patterns)
+    {
+        // one epsilon state per pattern, leading to its NFA and to the next pattern
+        auto start = std::make_shared<details::NFAState>(), state = start;
+        std::vector<details::NFAPtr> ends;
+        for (const auto &pattern : patterns)
+        {
+            auto str = details::str_to_utf8(pattern);
+            auto nfa = std::get<0>(details::Parse().gen_nfa(str.c_str()));
+            ends.push_back(nfa->end);
+
+            state->edge_type = details::NFAState::EdgeType::EPSILON;
+            state->next = nfa->start;
+            state->next2 = std::make_shared<details::NFAState>();
+            state = state->next2;
+        }
 
-    std::tuple<std::shared_ptr<DFAState>, bool, bool>
-    gen_dfa(const char32_t *reading)
+        auto dfa = details::NFAPair(start, state).to_dfa(ends, nullptr);
+        table = std::make_shared<details::DFATable>(dfa, true);
+        details::release(dfa);
+    }
+
+    // the longest token at pos of str, an empty match is no token; at or past the end of str it is an empty
+    // kError token
+    Token
+    next(std::string_view str, std::size_t pos) const
     {
-        std::shared_ptr<DFAState> dfa;
+        if (pos >= str.size())
+        {
+            return { kError, str.substr(str.size()) };
+        }
+        auto found = table->longest(str, pos);
+        if (found.first)
+        {
+            return { table->tokens[found.second], str.substr(pos, found.first) };
+        }
+        return skip(str, pos);
+    }
 
-        auto node = gen_node(reading);
-        dfa = node
-            ? node->compile()->to_dfa()
-            : std::make_shared<DFAState>(DFAState::State::END);
+    // the first token at or after pos of str, found in one pass over the characters which start none, so
+    // a run of them costs no rescan per character; an empty kError token at the end of str if there is none
+    Token
+    find(std::string_view str, std::size_t pos) const
+    {
+        auto size = str.size(), npos = std::string_view::npos;
+        auto found = table->search(str, pos, false, [size, npos](std::size_t pos)
+        {
+            return pos < size ? std::make_pair(pos, size - 1) : std::make_pair(npos, npos);
+        });
+        if (found.pos == npos)
+        {
+            return { kError, str.substr(size) };
+        }
+        return { table->tokens[found.state], str.substr(found.pos, found.len) };
+    }
 
-        return std::make_tuple(dfa, begin, end);
+    // the tokens of str in order, found one at a time as the iterator advances
+    Range
+    tokenize(std::string_view str) const
+    {
+        return Range(this, str);
     }
 };
-} // namespace details
 
-class Pattern
+// replaces the matches of many patterns in one pass with one DFA for all of them: the leftmost match is
+// found by Lexer::find, the longest match there wins and a tie goes to the rule listed first, as in Lexer;
+// replacements are copied as they are and '^' and '$' are ignored
+class Rewriter
 {
   private:
+    Lexer lexer;
+    std::vector<std::string> replacements;
 
-    details::DFAPtr dfa;
-    bool begin, end;
+    static std::vector<std::string>
+    patterns_of(const std::vector<std::pair<std::string, std::string>> &rules)
+    {
+        std::vector<std::string> res;
+        for (const auto &rule : rules)
+        {
+            res.push_back(rule.first);
+        }
+        return res;
+    }
 
   public:
-    Pattern(const std::string &pattern)
+    // rules are (pattern, replacement) pairs
+    Rewriter(const std::vector<std::pair<std::string, std::string>> &rules) : lexer(patterns_of(rules))
     {
-        auto str = details::str_to_utf8(pattern);
-        std::tie(dfa, begin, end) = details::Parse().gen_dfa(str.c_str());
+        for (const auto &rule : rules)
+        {
+            replacements.push_back(rule.second);
+        }
     }
 
-    std::u32string
-    match(const std::u32string &str)
+    // writes str to out with every match replaced, text between matches is copied in whole runs
+    template <typename OutputIt>
+    OutputIt
+    replace_to(OutputIt out, std::string_view str) const
+    {
+        std::size_t copied = 0;
+        for (auto token = lexer.find(str, 0); token.id != Lexer::kError; token = lexer.find(str, copied))
+        {
+            auto pos = static_cast<std::size_t>(token.text.data() - str.data());
+            out = std::copy(str.begin() + copied, str.begin() + pos, out);
+            out = std::copy(replacements[token.id].begin(), replacements[token.id].end(), out);
+            copied = pos + token.text.size();
+        }
+        return std::copy(str.begin() + copied, str.end(), out);
+    }
+
+    std::string
+    replace_all(std::string_view str) const
     {
-        std::u32string res, temp;
+        std::string res;
+        res.reserve(str.size());
+        replace_to(std::back_inserter(res), str);
+        return res;
+    }
+};
 
-        auto reading = str.c_str();
-        auto state = dfa;
+// a set of patterns which can be searched all at once and changed a few at a time: the patterns are kept in
+// shards of up to kShardSize, each compiled into one DFA, so add and remove only recompile one shard;
+// readers work on an immutable version which writers swap in through one atomic pointer; a reader only counts
+// itself in and out and never takes a lock, while a writer waits for the readers of the old version to leave
+// before it deletes it
+class PatternSet
+{
+  public:
+    static constexpr std::size_t kShardSize = 16;
 
-        while (*reading)
+  private:
+    struct Shard
+    {
+        std::vector<std::size_t> ids;
+        std::vector<std::string> patterns;
+        std::shared_ptr<details::DFATable> table;
+        // patterns which have to match up to the end of the input
+        std::uint64_t ends = 0;
+
+        Shard(std::vector<std::size_t> ids, std::vector<std::string> patterns)
+          : ids(std::move(ids)), patterns(std::move(patterns))
         {
-            if (state->contains_scope(*reading))
+            // the DFA starts at every pattern and restarts the patterns without '^' after every character,
+            // so it searches instead of matching a prefix
+            auto any = std::make_shared<details::NFAState>();
+            any->edge_type = details::NFAState::EdgeType::CCL;
+            any->scopes.insert({ details::kChar32Min, details::kChar32Max });
+
+            std::vector<details::NFAPtr> finals, entries, unanchored;
+            for (std::size_t i = 0; i < this->patterns.size(); ++i)
             {
-                state = state->get_next(*reading);
-            }
-            else if (end)
-            {
-                return std::u32string();
+                auto str = details::str_to_utf8(this->patterns[i]);
+                std::shared_ptr<details::NFAPair> nfa;
+                bool begin, end;
+                std::tie(nfa, begin, end) = details::Parse().gen_nfa(str.c_str());
+                finals.push_back(nfa->end);
+                entries.push_back(nfa->start);
+                if (!begin)
+                {
+                    unanchored.push_back(nfa->start);
+                }
+                ends |= std::uint64_t(end) << i;
             }
-            else
+
+            // epsilon states forking to every entry and then to any
+            auto fork = [&any](const std::vector<details::NFAPtr> &targets)
             {
-                break;
-            }
+                auto head = std::make_shared<details::NFAState>(), state = head;
+                for (const auto &target : targets)
+                {
+                    state->edge_type = details::NFAState::EdgeType::EPSILON;
+                    state->next = target;
+                    state->next2 = std::make_shared<details::NFAState>();
+                    state = state->next2;
+                }
+                state->edge_type = details::NFAState::EdgeType::EPSILON;
+                state->next = any;
+                return head;
+            };
+            auto start = fork(entries);
+            any->next = fork(unanchored);
+
+            auto dfa = details::NFAPair(start, any).to_dfa(finals, nullptr);
+            table = std::make_shared<details::DFATable>(dfa, true);
+            details::release(dfa);
+        }
 
-            temp += *reading;
+        // bits of the patterns with a match in str
+        std::uint64_t
+        scan(std::string_view str) const
+        {
+            auto all = patterns.size() == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << patterns.size()) - 1;
+            auto reading = reinterpret_cast<const unsigned char *>(str.data()), last = reading + str.size();
+            auto state = table->start;
+            auto found = table->masks[state] & ~ends;
+            char32_t chr;
 
-            if (state->state == details::DFAState::State::END)
+            while (found != all)
             {
-                res += temp;
-                temp.clear();
+                if (table->loops[state].ranges)
+                {
+                    reading = table->loops[state].skip(reading, last);
+                }
+                if (!details::read_utf8(reading, last, chr))
+                {
+                    break;
+                }
+                if ((state = table->next[state * table->classes + table->class_of(chr)]) == details::DFATable::kDead)
+                {
+                    return found;
+                }
+                found |= table->masks[state] & ~ends;
             }
-            ++reading;
+            return reading == last ? found | (table->masks[state] & ends) : found;
         }
+    };
 
-        return res;
-    }
+    struct Version
+    {
+        std::vector<std::shared_ptr<const Shard>> shards;
+    };
 
-    std::u32string
-    search(const std::u32string &str)
+    // readers count themselves in one of two counters, picked by the parity of epoch and striped over a few
+    // cache lines like Telemetry
+    static constexpr std::size_t kSlots = 4;
+
+    struct alignas(64) Slot
     {
-        if (begin)
+        std::atomic<std::size_t> readers[2]{};
+    };
+
+    std::atomic<const Version *> version{ new Version() };
+    mutable Slot slots[kSlots];
+    std::atomic<std::size_t> epoch{ 0 };
+    std::mutex writer;
+    std::size_t next_id = 0;
+
+    // keeps the version it loaded alive until it goes out of scope
+    class Reader
+    {
+      private:
+        std::atomic<std::size_t> &count;
+
+      public:
+        const Version *version;
+
+        Reader(const PatternSet &set) : count(set.slot().readers[set.epoch.load() & 1])
         {
-            return match(str);
+            count.fetch_add(1);
+            version = set.version.load();
         }
 
-        std::u32string res;
-        for (std::size_t i = 0; i < str.size(); ++i)
+        ~Reader() { count.fetch_sub(1); }
+
+        Reader(const Reader &) = delete;
+        Reader &operator=(const Reader &) = delete;
+    };
+
+    Slot &
+    slot() const
+    {
+        static std::atomic<std::size_t> threads{ 0 };
+        thread_local std::size_t index = threads.fetch_add(1, std::memory_order_relaxed) % kSlots;
+        return slots[index];
+    }
+
+    // the version writers copy from, only writers replace it and they hold the lock
+    const Version &
+    current() const
+    {
+        return *version.load();
+    }
+
+    // swaps in next and deletes the old version once no reader can still use it: a reader which counted
+    // itself in before the swap may have loaded the old version, so both counters have to drain, flipping
+    // epoch first so that new readers count themselves in the other one
+    void
+    publish(std::unique_ptr<Version> next)
+    {
+        std::unique_ptr<const Version> old(version.exchange(next.release()));
+        for (int round = 0; round < 2; ++round)
         {
-            res = match(str.substr(i));
-            if (!res.empty())
+            auto parity = epoch.fetch_add(1) & 1;
+            for (const auto &slot : slots)
             {
-                return res;
+                while (slot.readers[parity].load())
+                {
+                    std::this_thread::yield();
+                }
             }
         }
-
-        return res;
     }
 
-    std::u32string
-    replace(const std::u32string &str, const std::u32string &target)
+  public:
+    PatternSet() {}
+    ~PatternSet() { delete version.load(); }
+
+    PatternSet(const PatternSet &) = delete;
+    PatternSet &operator=(const PatternSet &) = delete;
+
+    // adds a pattern and returns its id, only the last shard is recompiled
+    std::size_t
+    add(const std::string &pattern)
     {
-        if (begin)
+        std::lock_guard<std::mutex> lock(writer);
+        auto next = std::make_unique<Version>(current());
+        auto id = next_id++;
+
+        if (!next->shards.empty() && next->shards.back()->ids.size() < kShardSize)
         {
-            return target + str.substr(match(str).size());
+            auto last = next->shards.back();
+            auto ids = last->ids;
+            auto patterns = last->patterns;
+            ids.push_back(id);
+            patterns.push_back(pattern);
+            next->shards.back() = std::make_shared<Shard>(std::move(ids), std::move(patterns));
+        }
+        else
+        {
+            next->shards.push_back(std::make_shared<Shard>(std::vector<std::size_t>{ id }, std::vector<std::string>{ pattern }));
         }
 
-        std::u32string res;
-        for (std::size_t i = 0; i < str.size(); ++i)
+        publish(std::move(next));
+        return id;
+    }
+
+    // removes the pattern with id, returns false if there is none, only its shard is recompiled
+    bool
+    remove(std::size_t id)
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        auto next = std::make_unique<Version>(current());
+
+        for (auto it = next->shards.begin(); it != next->shards.end(); ++it)
         {
-            auto tmp = match(str.substr(i));
-            if (tmp.empty())
+            auto found = std::find((*it)->ids.begin(), (*it)->ids.end(), id);
+            if (found == (*it)->ids.end())
             {
-                res += str[i];
+                continue;
+            }
+
+            auto ids = (*it)->ids;
+            auto patterns = (*it)->patterns;
+            patterns.erase(patterns.begin() + (found - (*it)->ids.begin()));
+            ids.erase(ids.begin() + (found - (*it)->ids.begin()));
+            if (ids.empty())
+            {
+                next->shards.erase(it);
             }
             else
             {
-                res += target;
-                i += tmp.size() - 1;
+                *it = std::make_shared<Shard>(std::move(ids), std::move(patterns));
             }
-        }
 
-        return res;
+            publish(std::move(next));
+            return true;
+        }
+        return false;
     }
 
-    std::string
-    match(const std::string &str)
+    // repacks the shards which removals left half empty, recompiling all of them
+    void
+    compact()
     {
-        return details::utf8_to_str(match(details::str_to_utf8(str)));
-    }
+        std::lock_guard<std::mutex> lock(writer);
+        auto next = std::make_unique<Version>();
+        std::vector<std::size_t> ids;
+        std::vector<std::string> patterns;
 
-    std::string
-    search(const std::string &str)
-    {
-        return details::utf8_to_str(search(details::str_to_utf8(str)));
+        for (const auto &shard : current().shards)
+        {
+            for (std::size_t i = 0; i < shard->ids.size(); ++i)
+            {
+                ids.push_back(shard->ids[i]);
+                patterns.push_back(shard->patterns[i]);
+                if (ids.size() == kShardSize)
+                {
+                    next->shards.push_back(std::make_shared<Shard>(std::move(ids), std::move(patterns)));
+                    ids.clear();
+                    patterns.clear();
+                }
+            }
+        }
+        if (!ids.empty())
+        {
+            next->shards.push_back(std::make_shared<Shard>(std::move(ids), std::move(patterns)));
+        }
+
+        publish(std::move(next));
     }
 
-    std::string
-    replace(const std::string &str, const std::string &target)
+    std::size_t
+    size() const
     {
-        return details::utf8_to_str(
-            replace(details::str_to_utf8(str),
-                details::str_to_utf8(target))
-        );
+        std::size_t res = 0;
+        Reader reader(*this);
+        for (const auto &shard : reader.version->shards)
+        {
+            res += shard->ids.size();
+        }
+        return res;
     }
 
-    std::vector<std::string>
-    matches(const std::string &str)
+    // ids of the patterns with a match anywhere in str, in the order they were added; '^' and '$' anchor a
+    // match to the start and the end of str, and a pattern accepting the empty string matches everything
+    std::vector<std::size_t>
+    matches(std::string_view str) const
     {
-        if (begin)
+        std::vector<std::size_t> res;
+        Reader reader(*this);
+        for (const auto &shard : reader.version->shards)
         {
-            return {match(str)};
+            auto found = shard->scan(str);
+            for (std::size_t i = 0; i < shard->ids.size(); ++i)
+            {
+                if (found >> i & 1)
+                {
+                    res.push_back(shard->ids[i]);
+                }
+            }
         }
+        return res;
+    }
 
-        std::vector<std::string> res;
-        for (std::size_t i = 0; i < str.size(); ++i)
+    // whether any pattern has a match in str
+    bool
+    any(std::string_view str) const
+    {
+        Reader reader(*this);
+        for (const auto &shard : reader.version->shards)
         {
-            auto tmp = match(str.substr(i));
-            if (!tmp.empty())
+            if (shard->scan(str))
             {
-                res.push_back(tmp);
-                i += tmp.size() - 1;
+                return true;
             }
         }
-
-        return res;
+        return false;
     }
 };
 
@@ -1419,6 +6935,12 @@ matches(const std::string &pattern, const std::string &str)
 {
     return Pattern(pattern).matches(str);
 }
+
+inline std::string
+replace_all(const std::vector<std::pair<std::string, std::string>> &rules, const std::string &str)
+{
+    return Rewriter(rules).replace_all(str);
+}
 } // namespace yare
 
 #endif // YETANOTHERREGEX_HPP
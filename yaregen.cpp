@@ -0,0 +1,372 @@
+// yaregen, compiles a list of patterns into specialized C++ matchers ahead of time.
+//
+//   g++ -std=c++17 -O2 yaregen.cpp -o yaregen
+//   ./yaregen [namespace] < rules.txt > rules.hpp
+//
+// every line of rules.txt is "name pattern", and becomes two functions in the generated header:
+//   std::size_t name(std::string_view str)
+//       byte length of the longest accepted prefix of str, npos if there is none, like Pattern::match
+//   std::pair<std::size_t, std::size_t> name_search(std::string_view str)
+//       leftmost non-empty match as (position, length), position is npos if there is none, found reading
+//       str once with every start still alive as a thread in the state it reached
+// the generated code only depends on the standard library. A name which is no C++ identifier is an error.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "yare.hpp"
+
+using namespace std;
+using yare::details::Scope;
+
+namespace
+{
+struct Rule
+{
+    string name;
+    string pattern;
+};
+
+// one interval of characters and the state it leads to, 0 is the dead state
+struct Edge
+{
+    Scope scope;
+    uint32_t target;
+};
+
+string
+label(uint32_t state)
+{
+    return state == yare::details::DFATable::kDead ? "fail" : "s" + to_string(state);
+}
+
+vector<Edge>
+edges_of(const yare::details::DFATable &table, uint32_t state)
+{
+    vector<Edge> edges;
+    for (size_t k = 0; k < table.classes; ++k)
+    {
+        auto target = table.next[state * table.classes + k];
+        auto scope = table.class_scope(k);
+        if (!edges.empty() && edges.back().target == target)
+        {
+            edges.back().scope.second = scope.second;
+        }
+        else
+        {
+            edges.push_back({ scope, target });
+        }
+    }
+    return edges;
+}
+
+// a binary decision over the sorted intervals, so every character needs O(log n) compares; it jumps to the
+// label of the target, or returns the target when returning
+void
+gen_dispatch(string &out, const vector<Edge> &edges, size_t lo, size_t hi, const string &indent, bool returning)
+{
+    if (lo == hi)
+    {
+        out += indent + (returning ? "return " + to_string(edges[lo].target) : "goto " + label(edges[lo].target)) + ";\n";
+        return;
+    }
+
+    auto mid = (lo + hi) / 2;
+    out += indent + "if (chr <= " + to_string(edges[mid].scope.second) + "U)\n";
+    out += indent + "{\n";
+    gen_dispatch(out, edges, lo, mid, indent + "    ", returning);
+    out += indent + "}\n";
+    gen_dispatch(out, edges, mid + 1, hi, indent, returning);
+}
+
+string
+gen_rule(const Rule &rule)
+{
+    auto str = yare::details::str_to_utf8(rule.pattern);
+    yare::details::DFAPtr dfa;
+    bool begin, end;
+    tie(dfa, begin, end) = yare::details::Parse().gen_dfa(str.c_str());
+    yare::details::DFATable table(dfa);
+    yare::details::release(dfa);
+
+    // a block comment, since a line comment ending in a backslash would swallow the next line
+    string comment = rule.pattern;
+    for (auto pos = comment.find("*/"); pos != string::npos; pos = comment.find("*/", pos))
+    {
+        comment.replace(pos, 2, "*\\/");
+    }
+
+    string out;
+    out += "/* " + comment + " */\n";
+    out += "inline std::size_t\n" + rule.name + "(std::string_view str)\n{\n";
+    out += "    auto reading = reinterpret_cast<const unsigned char *>(str.data());\n";
+    out += "    auto first = reading, last = reading + str.size();\n";
+    out += "    auto res = std::string_view::npos;\n";
+    out += "    char32_t chr;\n\n";
+
+    bool failing = false;
+    out += "    goto " + label(table.start) + ";\n\n";
+    for (uint32_t state = table.start; state < table.states(); ++state)
+    {
+        out += label(state) + ":\n";
+        if (table.accept[state])
+        {
+            out += "    res = reading - first;\n";
+        }
+        out += "    if (!read_utf8(reading, last, chr))\n    {\n        return res;\n    }\n";
+
+        auto edges = edges_of(table, state);
+        for (const auto &edge : edges)
+        {
+            failing = failing || edge.target == yare::details::DFATable::kDead;
+        }
+        gen_dispatch(out, edges, 0, edges.size() - 1, "    ", false);
+        out += "\n";
+    }
+
+    if (failing)
+    {
+        out += "fail:\n";
+        out += end ? "    return std::string_view::npos;\n" : "    return res;\n";
+    }
+    out += "}\n\n";
+
+    out += "inline std::pair<std::size_t, std::size_t>\n" + rule.name + "_search(std::string_view str)\n{\n";
+    if (begin)
+    {
+        out += "    auto len = " + rule.name + "(str);\n";
+        out += "    if (len && len != std::string_view::npos)\n    {\n        return { 0, len };\n    }\n";
+    }
+    else
+    {
+        string accept;
+        for (uint32_t state = 0; state < table.states(); ++state)
+        {
+            accept += table.accept[state] ? "true, " : "false, ";
+        }
+        out += "    static constexpr bool accept[] = { " + accept + "};\n";
+        out += "    auto step = [](std::uint32_t state, char32_t chr) -> std::uint32_t\n    {\n";
+        out += "        switch (state)\n        {\n";
+        for (uint32_t state = table.start; state < table.states(); ++state)
+        {
+            auto edges = edges_of(table, state);
+            out += "        case " + to_string(state) + ":\n";
+            gen_dispatch(out, edges, 0, edges.size() - 1, "            ", true);
+        }
+        out += "        }\n        return 0;\n    };\n";
+        out += "    return search(str, " + to_string(table.start) + ", accept, " + (end ? "true" : "false") + ", step);\n";
+        out += "}\n\n";
+        return out;
+    }
+    out += "    return { std::string_view::npos, 0 };\n";
+    out += "}\n\n";
+
+    return out;
+}
+
+bool
+is_identifier(const string &name)
+{
+    auto alpha = [](char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; };
+    return !name.empty() && alpha(name[0])
+        && all_of(name.begin(), name.end(), [&alpha](char c) { return alpha(c) || (c >= '0' && c <= '9'); });
+}
+
+const char *kPrelude = R"(#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <utility>
+#include <string_view>
+
+namespace %s
+{
+// same decoding as yare::details::read_utf8
+inline std::size_t
+utf8_length(unsigned char lead)
+{
+    return lead < 0x80U ? 1 : lead < 0xE0U ? 2 : lead < 0xF0U ? 3 : lead < 0xF8U ? 4 : 1;
+}
+
+inline bool
+read_utf8(const unsigned char *&reading, const unsigned char *last, char32_t &chr)
+{
+    if (reading == last || !*reading || *reading >= 0xF8U)
+    {
+        return false;
+    }
+
+    auto size = utf8_length(*reading);
+    if (static_cast<std::size_t>(last - reading) < size)
+    {
+        return false;
+    }
+
+    chr = *reading++;
+    while (--size)
+    {
+        (chr <<= 8) |= *reading++;
+    }
+    return true;
+}
+
+// leftmost non-empty match as (position, length) of the DFA moving by step, 0 is its dead state: every
+// start is a thread in the state it reached, the threads in one state go on as the earliest of them, so
+// str is read once; like yare, with end an attempt that dies before str does has no match
+template <typename Step, std::size_t kStates>
+std::pair<std::size_t, std::size_t>
+search(std::string_view str, std::uint32_t start, const bool (&accept)[kStates], bool end, Step step)
+{
+    using Found = std::pair<std::size_t, std::size_t>;
+    struct Thread
+    {
+        std::uint32_t state;
+        std::size_t start;
+        Found found;
+    };
+
+    constexpr auto npos = std::string_view::npos;
+    auto before = [](const Found &lhs, const Found &rhs)
+    {
+        return lhs.first < rhs.first || (lhs.first == rhs.first && lhs.second > rhs.second);
+    };
+
+    std::vector<Thread> threads, moved;
+    std::vector<std::size_t> owner(kStates, 0);
+    Found res = { npos, 0 };
+    auto first = reinterpret_cast<const unsigned char *>(str.data()), last = first + str.size();
+    bool spawning = true;
+    char32_t chr;
+
+    for (std::size_t pos = 0;;)
+    {
+        // without end a match stays once found, so the starts after the leftmost one can not win any more
+        if (!end)
+        {
+            auto leftmost = res.first;
+            for (const auto &thread : threads)
+            {
+                leftmost = leftmost < thread.found.first ? leftmost : thread.found.first;
+            }
+            if (leftmost != npos)
+            {
+                spawning = false;
+                while (!threads.empty() && threads.back().start > leftmost)
+                {
+                    threads.pop_back();
+                }
+            }
+        }
+        if (spawning && pos < str.size())
+        {
+            threads.push_back({ start, pos, { npos, 0 } });
+        }
+        if (threads.empty())
+        {
+            return res;
+        }
+
+        auto reading = first + pos;
+        if (!read_utf8(reading, last, chr))
+        {
+            // every attempt stops here and keeps the longest match it has
+            for (const auto &thread : threads)
+            {
+                res = before(thread.found, res) ? thread.found : res;
+            }
+            threads.clear();
+            if (res.first != npos || pos == str.size())
+            {
+                return res;
+            }
+            pos += utf8_length(str[pos]);
+            continue;
+        }
+
+        moved.clear();
+        for (auto &thread : threads)
+        {
+            auto target = step(thread.state, chr);
+            if (!target)
+            {
+                res = !end && before(thread.found, res) ? thread.found : res;
+                continue;
+            }
+            if (accept[target])
+            {
+                thread.found = { thread.start, static_cast<std::size_t>(reading - first) - thread.start };
+            }
+            if (owner[target])
+            {
+                auto &earlier = moved[owner[target] - 1];
+                earlier.found = before(thread.found, earlier.found) ? thread.found : earlier.found;
+                continue;
+            }
+            moved.push_back({ target, thread.start, thread.found });
+            owner[target] = moved.size();
+        }
+        for (const auto &thread : moved)
+        {
+            owner[thread.state] = 0;
+        }
+        threads.swap(moved);
+        pos = reading - first;
+    }
+}
+
+)";
+// the header for the rules read from in, or false with error set to the first bad line
+bool
+gen_header(istream &in, const string &ns, string &out, string &error)
+{
+    if (!is_identifier(ns))
+    {
+        error = "namespace '" + ns + "' is no C++ identifier";
+        return false;
+    }
+
+    vector<Rule> rules;
+    size_t number = 0;
+    for (string line; getline(in, line);)
+    {
+        ++number;
+        auto split = line.find(' ');
+        if (line.empty() || line[0] == '#' || split == string::npos)
+        {
+            continue;
+        }
+        rules.push_back({ line.substr(0, split), line.substr(split + 1) });
+        if (!is_identifier(rules.back().name))
+        {
+            error = "line " + to_string(number) + ": name '" + rules.back().name + "' is no C++ identifier";
+            return false;
+        }
+    }
+
+    vector<char> prelude(string(kPrelude).size() + ns.size());
+    snprintf(prelude.data(), prelude.size(), kPrelude, ns.c_str());
+    out = "// generated by yaregen, do not edit\n#pragma once\n\n";
+    out += prelude.data();
+    for (const auto &rule : rules)
+    {
+        out += gen_rule(rule);
+    }
+    out += "} // namespace " + ns + "\n";
+    return true;
+}
+} // namespace
+
+#if !defined(YAREGEN_NO_MAIN)
+int main(int argc, char *argv[])
+{
+    string out, error;
+    if (!gen_header(cin, argc > 1 ? argv[1] : "yaregen", out, error))
+    {
+        fprintf(stderr, "yaregen: %s\n", error.c_str());
+        return 1;
+    }
+    printf("%s", out.c_str());
+    return 0;
+}
+#endif